@@ -1,7 +1,53 @@
 #include "cached_interpreter.h"
 #include "common_recompiler.h"
 #include "interpreter.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+
+GBCachedInterpreter::GBCachedInterpreter(const Config& config)
+    : cache_size(std::min(config.code_cache_size, CACHE_SIZE)),
+      code(cache_size) {
+  if (config.perf_map) {
+    const auto path = fmt::format("/tmp/perf-{}.map", getpid());
+    // shared by every core in the process
+    perf_map.open(path, std::ios::app);
+    if (!perf_map.is_open()) {
+      PRINT("Unable to open perf map {}\n", path);
+    }
+  }
+  block_stats_enabled = config.block_stats;
+  if (config.background_compile) {
+    compile_thread = std::thread(&GBCachedInterpreter::compile_worker, this);
+  }
+}
+
+GBCachedInterpreter::~GBCachedInterpreter() {
+  if (compile_thread.joinable()) {
+    {
+      std::lock_guard lock(queue_mutex);
+      stop_compiling = true;
+    }
+    queue_cv.notify_one();
+    compile_thread.join();
+  }
+
+  for (auto* page : block_page_table) {
+    delete[] page;
+  }
+  for (auto& pages : rom_bank_pages) {
+    for (auto* page : pages) {
+      delete[] page;
+    }
+  }
+}
 
 void GBCachedInterpreter::emit_prologue(Core& core) {
   code.push(rbp);
@@ -9,11 +55,19 @@ void GBCachedInterpreter::emit_prologue(Core& core) {
 
   code.push(SAVED1);
   code.push(SAVED2);
+  // callee saved registers we cache guest registers in
+  code.push(rbx);
+  code.push(r14);
+  code.push(r15);
+  // keep rsp 16-byte aligned for the calls we make
   code.sub(rsp, 8);
 }
 
 void GBCachedInterpreter::emit_epilogue(Core& core) {
   code.add(rsp, 8);
+  code.pop(r15);
+  code.pop(r14);
+  code.pop(rbx);
   code.pop(SAVED2);
   code.pop(SAVED1);
 
@@ -21,58 +75,1676 @@ void GBCachedInterpreter::emit_epilogue(Core& core) {
   code.ret();
 }
 
+// Fallbacks return the cycles they take beyond the static timing of their
+// instruction, which only conditional branches ever do, and those are emitted
+// natively (see emit_conditional_exit). So what they return is ignored
 void GBCachedInterpreter::emit_fallback_no_params(no_params_fp fallback,
                                                   Core& core) {
+  emit_flush_flags(core);
+  emit_writeback_regs(core);
   code.mov(rax, (uintptr_t)fallback);
   code.mov(PARAM1, (uintptr_t)&core);
   code.call(rax);
+  // the fallback may have changed any guest register
+  guest_regs = {};
 }
 
 void GBCachedInterpreter::emit_fallback_one_params(one_params_fp fallback,
                                                    Core& core, int first) {
+  emit_flush_flags(core);
+  emit_writeback_regs(core);
   code.mov(rax, (uintptr_t)fallback);
   code.mov(PARAM1, (uintptr_t)&core);
   code.mov(PARAM2, (int64_t)first);
   code.call(rax);
+  // the fallback may have changed any guest register
+  guest_regs = {};
 }
 
 void GBCachedInterpreter::emit_fallback_two_params(two_params_fp fallback,
                                                    Core& core, int first,
                                                    int second) {
+  emit_flush_flags(core);
+  emit_writeback_regs(core);
   code.mov(rax, (uintptr_t)fallback);
   code.mov(PARAM1, (uintptr_t)&core);
   code.mov(PARAM2, (int64_t)first);
   code.mov(PARAM3, (int64_t)second);
   code.call(rax);
+  // the fallback may have changed any guest register
+  guest_regs = {};
+}
+
+// Same register order as get_r8 in the interpreter: B, C, D, E, H, L, (HL), A
+Xbyak::Address GBCachedInterpreter::get_r8_address(Core& core, int r8) {
+  static constexpr std::array<std::pair<int, int>, 8> r8_map = {{
+      {Regs::BC, 1},
+      {Regs::BC, 0},
+      {Regs::DE, 1},
+      {Regs::DE, 0},
+      {Regs::HL, 1},
+      {Regs::HL, 0},
+      {-1, -1},
+      {Regs::AF, 1},
+  }};
+  const auto [reg, byte_offset] = r8_map[r8];
+  if (reg == -1) {
+    PANIC("(HL) has no register address!\n");
+  }
+
+  auto* address = reinterpret_cast<uint8_t*>(&core.regs[reg]) + byte_offset;
+  return byte[SAVED2 + get_offset(core, address)];
+}
+
+// Host register that guest r8 lives in for the rest of the block. It is only
+// loaded from Core::regs on first use, and only stored back by
+// emit_writeback_regs if it has been written to
+Xbyak::Reg8 GBCachedInterpreter::get_r8(Core& core, int r8, RegAccess access) {
+  if (r8 == 6) {
+    PANIC("(HL) has no host register!\n");
+  }
+
+  const auto host = HOST_R8[r8];
+  if (!guest_regs.loaded[r8] && access != RegAccess::Write) {
+    code.mov(host, get_r8_address(core, r8));
+  }
+  guest_regs.loaded[r8] = true;
+  if (access != RegAccess::Read) {
+    guest_regs.dirty[r8] = true;
+  }
+  return host;
+}
+
+Xbyak::Reg16 GBCachedInterpreter::get_sp(Core& core, RegAccess access) {
+  if (!guest_regs.loaded[SP_SLOT] && access != RegAccess::Write) {
+    code.mov(HOST_SP, word[SAVED2 + get_offset(core, &core.sp)]);
+  }
+  guest_regs.loaded[SP_SLOT] = true;
+  if (access != RegAccess::Read) {
+    guest_regs.dirty[SP_SLOT] = true;
+  }
+  return HOST_SP;
+}
+
+// Store modified guest registers back to the core, for fallbacks and block
+// exits. They stay loaded
+void GBCachedInterpreter::emit_writeback_regs(Core& core) {
+  for (int r8 = 0; r8 < 8; r8++) {
+    if (guest_regs.dirty[r8]) {
+      code.mov(get_r8_address(core, r8), HOST_R8[r8]);
+      guest_regs.dirty[r8] = false;
+    }
+  }
+
+  if (guest_regs.dirty[SP_SLOT]) {
+    code.mov(word[SAVED2 + get_offset(core, &core.sp)], HOST_SP);
+    guest_regs.dirty[SP_SLOT] = false;
+  }
+}
+
+// Host flag bits (as laid out by lahf) that the guest Z, H and C flags are
+// computed from. N has no host equivalent
+static uint8_t host_flag_bits(uint8_t flags) {
+  return (flags & (FLAG_Z | FLAG_H)) >> 1 | (flags & FLAG_C) >> 4;
+}
+
+// Expects the host flags of the last flag producing operation in cl (see
+// emit_defer_flags), and merges them into F:
+// -> from_host: Z, H and C are taken from ZF, AF and CF
+// -> set: forced to 1
+// -> keep: left as they were
+// Anything else is cleared. The lower nibble of F is always preserved.
+void GBCachedInterpreter::emit_update_flags(Core& core, uint8_t from_host,
+                                            uint8_t set, uint8_t keep) {
+  auto flags = byte[SAVED2 + get_offset(core, &core.regs[Regs::AF])];
+
+  if (from_host) {
+    // cl = SF:ZF:0:AF:0:PF:1:CF, so ZF and AF are one shift away from Z and H
+    code.movzx(eax, cl);
+    if (from_host & FLAG_C) {
+      code.mov(edx, eax);
+      code.and_(edx, 1);
+      code.shl(edx, 4);
+    }
+    code.and_(eax, (from_host & (FLAG_Z | FLAG_H)) >> 1);
+    code.add(eax, eax);
+    if (from_host & FLAG_C) {
+      code.or_(eax, edx);
+    }
+  } else {
+    code.xor_(eax, eax);
+  }
+
+  code.movzx(edx, flags);
+  code.and_(edx, keep | 0x0F);
+  code.or_(eax, edx);
+  if (set) {
+    code.or_(eax, set);
+  }
+  code.mov(flags, al);
+}
+
+// Records the flags of the host operation that was just emitted, without
+// writing them back to F. Guest flags are only materialized by
+// emit_flush_flags, once something actually needs F: a fallback, or the end
+// of the block. Until then, each flag producing operation simply overwrites
+// the pending state of the last one, and most flag updates never make it to
+// memory. Arguments are the same as for emit_update_flags.
+// Flags outside live_flags are overwritten before anything reads them, so they
+// are cleared, which takes no code at all
+void GBCachedInterpreter::emit_defer_flags(Core&, uint8_t from_host,
+                                           uint8_t set, uint8_t keep) {
+  auto& pending = pending_flags;
+  from_host &= live_flags;
+  set &= live_flags;
+  keep &= live_flags;
+  // flags we keep that haven't been written to F yet, and still live in cl
+  const auto carried = host_flag_bits(keep & pending.from_host);
+
+  if (from_host) {
+    code.lahf();
+    if (carried) {
+      code.and_(ecx, carried);
+      code.and_(ah, (uint8_t)~carried);
+      code.or_(cl, ah);
+    } else {
+      code.mov(cl, ah);
+    }
+  }
+
+  const uint8_t cleared = 0xF0 & ~(from_host | set | keep);
+  pending.from_host = from_host | (keep & pending.from_host);
+  pending.set = set | (keep & pending.set);
+  pending.clear = cleared | (keep & pending.clear);
+}
+
+void GBCachedInterpreter::emit_flush_flags(Core& core) {
+  auto& pending = pending_flags;
+  const uint8_t written = pending.from_host | pending.set | pending.clear;
+  if (!written) {
+    return;
+  }
+
+  emit_update_flags(core, pending.from_host, pending.set, 0xF0 & ~written);
+  pending = {};
+}
+
+// Guest carry -> host carry, for ADC and SBC
+void GBCachedInterpreter::emit_load_carry(Core& core) {
+  const auto& pending = pending_flags;
+
+  if (pending.from_host & FLAG_C) {
+    code.bt(ecx, 0);
+  } else if (pending.set & FLAG_C) {
+    code.stc();
+  } else if (pending.clear & FLAG_C) {
+    code.clc();
+  } else {
+    code.bt(word[SAVED2 + get_offset(core, &core.regs[Regs::AF])], 4);
+  }
+}
+
+// Guest state at a memory call, from the metadata emit_memory_call leaves
+// right after it: a short jmp over the pc
+GuestState GBCachedInterpreter::guest_state_at(const void* return_address) {
+  const auto* metadata = static_cast<const uint8_t*>(return_address);
+  if (metadata[0] != 0xEB || metadata[1] != sizeof(GuestState)) {
+    PANIC("No guest state at {}\n", return_address);
+  }
+
+  GuestState state;
+  memcpy(&state, metadata + 2, sizeof(state));
+  return state;
+}
+
+// I/O registers see core.pc where the interpreter would have left it, while
+// the rest of the block keeps assuming the value it last stored
+struct ScopedGuestPc {
+  Core& core;
+  uint16_t pc;
+  ScopedGuestPc(Core& core, const void* return_address, uint16_t addr)
+      : core(core), pc(core.pc) {
+    if (addr >= 0xFF00) {
+      core.pc = GBCachedInterpreter::guest_state_at(return_address).pc;
+    }
+  }
+  ~ScopedGuestPc() { core.pc = pc; }
+};
+
+static uint8_t read_byte(Core& core, uint16_t addr) {
+  ScopedGuestPc guest_pc(core, __builtin_return_address(0), addr);
+  return core.mem_read<uint8_t>(addr);
+}
+
+static void write_byte(Core& core, uint16_t addr, uint8_t value) {
+  ScopedGuestPc guest_pc(core, __builtin_return_address(0), addr);
+  core.mem_byte_reference<true>(addr, value) = value;
+}
+
+// Calls read_byte/write_byte with the address in eax and the value in dl.
+// Unlike fallbacks, this happens in the middle of an instruction, so every
+// caller saved register that holds block state is preserved instead of being
+// written back. core.pc isn't up to date here, so guest_state is left in the
+// code after the call, for anything that needs it to find through the return
+// address (see guest_state_at)
+void GBCachedInterpreter::emit_memory_call(Core& core, void* fn) {
+  static const std::array<Xbyak::Reg64, 7> preserved = {rcx, rsi, rdi, r8,
+                                                        r9,  r10, r11};
+  for (const auto& reg : preserved) {
+    code.push(reg);
+  }
+  code.sub(rsp, 8);
+
+  code.mov(PARAM2.cvt32(), eax);
+  code.movzx(PARAM3.cvt32(), dl);
+  code.mov(PARAM1, (uintptr_t)&core);
+  code.mov(rax, (uintptr_t)fn);
+  code.call(rax);
+  Xbyak::Label skip;
+  code.jmp(skip, Xbyak::CodeGenerator::T_SHORT);
+  code.dw(guest_state.pc);
+  code.L(skip);
+
+  code.add(rsp, 8);
+  for (auto it = preserved.rbegin(); it != preserved.rend(); it++) {
+    code.pop(*it);
+  }
+}
+
+// Loads the address held in guest register pair BC, DE or HL into eax
+void GBCachedInterpreter::emit_r16_address(Core& core, int gp1) {
+  code.movzx(eax, get_r8(core, gp1 * 2, RegAccess::Read));
+  code.shl(eax, 8);
+  code.mov(al, get_r8(core, gp1 * 2 + 1, RegAccess::Read));
+}
+
+// Reads the byte at the guest address in eax into al. Pages mapped in
+// Core::read_pages are read directly and HRAM is special cased, anything else
+// goes through Core::mem_read
+void GBCachedInterpreter::emit_read_u8(Core& core) {
+  Xbyak::Label slow, call, done;
+
+  code.mov(edx, eax);
+  code.shr(edx, 8);
+  code.mov(rdx,
+           qword[SAVED2 + rdx * 8 + get_offset(core, core.read_pages.data())]);
+  code.test(rdx, rdx);
+  code.jz(slow);
+  code.movzx(eax, al);
+  code.mov(al, byte[rdx + rax]);
+  code.jmp(done, code.T_NEAR);
+
+  code.L(slow);
+  code.cmp(eax, 0xFF80);
+  code.jb(call);
+  code.cmp(eax, 0xFFFF);
+  code.je(call);
+  code.mov(rdx, (uintptr_t)core.hram.data());
+  code.mov(al, byte[rdx + rax - 0xFF80]);
+  code.jmp(done);
+
+  code.L(call);
+  emit_memory_call(core, (void*)read_byte);
+  code.L(done);
+}
+
+// Writes dl to the guest address in eax. Same as emit_read_u8, using
+// Core::write_pages, which leaves out pages with compiled code in them
+void GBCachedInterpreter::emit_write_u8(Core& core) {
+  Xbyak::Label slow, call, done;
+
+  code.mov(edi, eax);
+  code.shr(edi, 8);
+  code.mov(rdi,
+           qword[SAVED2 + rdi * 8 + get_offset(core, core.write_pages.data())]);
+  code.test(rdi, rdi);
+  code.jz(slow);
+  code.movzx(eax, al);
+  code.mov(byte[rdi + rax], dl);
+  code.jmp(done, code.T_NEAR);
+
+  code.L(slow);
+  code.cmp(eax, 0xFF80);
+  code.jb(call);
+  code.cmp(eax, 0xFFFF);
+  code.je(call);
+  code.cmp(byte[SAVED2 + get_offset(core, &core.code_bitmap[0xFF])], 0);
+  code.jne(call);
+  code.mov(rdi, (uintptr_t)core.hram.data());
+  code.mov(byte[rdi + rax - 0xFF80], dl);
+  code.jmp(done);
+
+  code.L(call);
+  emit_memory_call(core, (void*)write_byte);
+  code.L(done);
+}
+
+// LD A, (BC/DE/HL+/HL-)
+void GBCachedInterpreter::emit_ld_a_r16_addr(Core& core, int gp2) {
+  emit_r16_address(core, std::min(gp2, 2));
+  emit_read_u8(core);
+  code.mov(get_r8(core, 7, RegAccess::Write), al);
+  emit_hl_step(core, gp2);
+}
+
+// LD (BC/DE/HL+/HL-), A
+void GBCachedInterpreter::emit_ld_r16_addr_a(Core& core, int gp2) {
+  emit_r16_address(core, std::min(gp2, 2));
+  code.mov(dl, get_r8(core, 7, RegAccess::Read));
+  emit_write_u8(core);
+  emit_hl_step(core, gp2);
+}
+
+void GBCachedInterpreter::emit_hl_step(Core& core, int gp2) {
+  if (gp2 == 2) {
+    emit_inc_r16(core, 2);
+  } else if (gp2 == 3) {
+    emit_dec_r16(core, 2);
+  }
+}
+
+// Host byte behind guest addr, if accessing it does nothing more than that:
+// VRAM, WRAM (and its echo, for reads), OAM, HRAM, and I/O registers without
+// side effects. None of these ever move
+static uint8_t* direct_address(Core& core, uint16_t addr, bool write) {
+  if (in_between(0x8000, 0x9FFF, addr)) {
+    return &core.vram[addr - 0x8000];
+  } else if (in_between(0xC000, 0xDFFF, addr)) {
+    return &core.wram[addr - 0xC000];
+  } else if (in_between(0xE000, 0xFDFF, addr) && !write) {
+    return &core.wram[addr - 0xE000];
+  } else if (in_between(0xFE00, 0xFE9F, addr)) {
+    return &core.oam[addr - 0xFE00];
+  } else if (in_between(0xFF80, 0xFFFE, addr)) {
+    return &core.hram[addr - 0xFF80];
+  } else if (addr >= 0xFF00) {
+    return core.mmio_storage(addr, write);
+  }
+  return nullptr;
+}
+
+// I/O registers with side effects, at an address known at compile time
+static uint8_t read_mmio(Core& core, uint16_t addr) {
+  ScopedGuestPc guest_pc(core, __builtin_return_address(0), addr);
+  return core.handle_mmio<false>(addr);
+}
+
+static void write_mmio(Core& core, uint16_t addr, uint8_t value) {
+  ScopedGuestPc guest_pc(core, __builtin_return_address(0), addr);
+  core.handle_mmio<true>(addr, value) = value;
+}
+
+// Operand for a byte found by direct_address: relative to SAVED2 for members
+// of the core, through rax for anything it allocated
+Xbyak::Address GBCachedInterpreter::get_host_byte(Core& core, uint8_t* host) {
+  const auto offset = get_offset(core, host);
+  if (offset < sizeof(Core)) {
+    return byte[SAVED2 + offset];
+  }
+
+  code.mov(rax, (uintptr_t)host);
+  return byte[rax];
+}
+
+// LD A, (u16) / LDH A, (u8), for any address known at compile time. Plain
+// memory and I/O registers are loaded from directly, and other I/O registers
+// call their handler without going through mem_read. Cartridge ROM that can't
+// be remapped under the block has been folded into an immediate already (see
+// optimize_ir). Any other ROM is read through its page in Core::read_pages,
+// which follows bank and bootrom changes
+void GBCachedInterpreter::emit_ld_a_addr(Core& core, uint16_t addr) {
+  if (auto* host = direct_address(core, addr, false)) {
+    const auto src = get_host_byte(core, host);
+    code.mov(get_r8(core, 7, RegAccess::Write), src);
+    return;
+  }
+
+  if (addr < 0x8000) {
+    const auto* page = &core.read_pages[addr >> 8];
+    code.mov(rax, qword[SAVED2 + get_offset(core, page)]);
+    code.mov(get_r8(core, 7, RegAccess::Write), byte[rax + (addr & 0xFF)]);
+    return;
+  }
+
+  code.mov(eax, addr);
+  if (addr >= 0xFF00) {
+    emit_memory_call(core, (void*)read_mmio);
+  } else {
+    emit_read_u8(core);
+  }
+  code.mov(get_r8(core, 7, RegAccess::Write), al);
+}
+
+// LD (u16), A / LDH (u8), A, resolved the same way as emit_ld_a_addr. Stores to
+// plain memory still check Core::code_bitmap, and leave pages with code in them
+// to write_byte, which invalidates it
+void GBCachedInterpreter::emit_ld_addr_a(Core& core, uint16_t addr) {
+  const auto acc = get_r8(core, 7, RegAccess::Read);
+  auto* host = direct_address(core, addr, true);
+
+  if (host && (in_between(0xFF00, 0xFF7F, addr) || addr == 0xFFFF)) {
+    code.mov(get_host_byte(core, host), acc);
+    return;
+  }
+
+  if (host) {
+    Xbyak::Label slow, done;
+    code.cmp(byte[SAVED2 + get_offset(core, &core.code_bitmap[addr >> 8])], 0);
+    code.jne(slow);
+    code.mov(get_host_byte(core, host), acc);
+    code.jmp(done, code.T_NEAR);
+
+    code.L(slow);
+    code.mov(eax, addr);
+    code.mov(dl, acc);
+    emit_memory_call(core, (void*)write_byte);
+    code.L(done);
+    return;
+  }
+
+  code.mov(eax, addr);
+  code.mov(dl, acc);
+  if (addr >= 0xFF00) {
+    emit_memory_call(core, (void*)write_mmio);
+  } else if (addr < 0x8000) {
+    // MBC registers
+    emit_memory_call(core, (void*)write_byte);
+  } else {
+    emit_write_u8(core);
+  }
+}
+
+void GBCachedInterpreter::emit_ld_a_c(Core& core) {
+  code.movzx(eax, get_r8(core, 1, RegAccess::Read));
+  code.or_(eax, 0xFF00);
+  emit_read_u8(core);
+  code.mov(get_r8(core, 7, RegAccess::Write), al);
+}
+
+void GBCachedInterpreter::emit_ld_c_a(Core& core) {
+  code.movzx(eax, get_r8(core, 1, RegAccess::Read));
+  code.or_(eax, 0xFF00);
+  code.mov(dl, get_r8(core, 7, RegAccess::Read));
+  emit_write_u8(core);
+}
+
+void GBCachedInterpreter::emit_ld_r8_r8(Core& core, int dest, int src) {
+  if (src == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.mov(get_r8(core, dest, RegAccess::Write), al);
+    return;
+  }
+
+  if (dest == 6) {
+    emit_r16_address(core, 2);
+    code.mov(dl, get_r8(core, src, RegAccess::Read));
+    emit_write_u8(core);
+    return;
+  }
+
+  const auto value = get_r8(core, src, RegAccess::Read);
+  code.mov(get_r8(core, dest, RegAccess::Write), value);
+}
+
+void GBCachedInterpreter::emit_ld_r8_u8(Core& core, int dest, uint8_t imm) {
+  if (dest == 6) {
+    emit_r16_address(core, 2);
+    code.mov(dl, imm);
+    emit_write_u8(core);
+  } else {
+    code.mov(get_r8(core, dest, RegAccess::Write), imm);
+  }
+}
+
+void GBCachedInterpreter::emit_ld_r16_u16(Core& core, int gp1, uint16_t imm) {
+  if (gp1 == 3) {
+    code.mov(get_sp(core, RegAccess::Write), imm);
+    return;
+  }
+
+  code.mov(get_r8(core, gp1 * 2, RegAccess::Write), imm >> 8);
+  code.mov(get_r8(core, gp1 * 2 + 1, RegAccess::Write), imm & 0xFF);
+}
+
+// Applies ALU operation `op` (in opcode order: ADD, ADC, SUB, SBC, AND, XOR,
+// OR, CP) to A, with the second operand in dl
+void GBCachedInterpreter::emit_alu_a(Core& core, int op) {
+  // CP leaves A alone
+  const auto acc =
+      get_r8(core, 7, op == 7 ? RegAccess::Read : RegAccess::ReadWrite);
+
+  switch (op) {
+    case 0:
+      code.add(acc, dl);
+      emit_defer_flags(core, FLAG_Z | FLAG_H | FLAG_C, 0, 0);
+      break;
+    case 1:
+      emit_load_carry(core);
+      code.adc(acc, dl);
+      emit_defer_flags(core, FLAG_Z | FLAG_H | FLAG_C, 0, 0);
+      break;
+    case 2:
+      code.sub(acc, dl);
+      emit_defer_flags(core, FLAG_Z | FLAG_H | FLAG_C, FLAG_N, 0);
+      break;
+    case 3:
+      emit_load_carry(core);
+      code.sbb(acc, dl);
+      emit_defer_flags(core, FLAG_Z | FLAG_H | FLAG_C, FLAG_N, 0);
+      break;
+    case 4:
+      // AF is undefined after logical ops, so H is set at compile time
+      code.and_(acc, dl);
+      emit_defer_flags(core, FLAG_Z, FLAG_H, 0);
+      break;
+    case 5:
+      code.xor_(acc, dl);
+      emit_defer_flags(core, FLAG_Z, 0, 0);
+      break;
+    case 6:
+      code.or_(acc, dl);
+      emit_defer_flags(core, FLAG_Z, 0, 0);
+      break;
+    case 7:
+      code.cmp(acc, dl);
+      emit_defer_flags(core, FLAG_Z | FLAG_H | FLAG_C, FLAG_N, 0);
+      break;
+    default:
+      PANIC("Invalid ALU operation: {}\n", op);
+  }
+}
+
+void GBCachedInterpreter::emit_alu_a_r8(Core& core, int op, int r8) {
+  if (r8 == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.mov(dl, al);
+  } else {
+    code.mov(dl, get_r8(core, r8, RegAccess::Read));
+  }
+  emit_alu_a(core, op);
+}
+
+void GBCachedInterpreter::emit_alu_a_u8(Core& core, int op, uint8_t imm) {
+  code.mov(dl, imm);
+  emit_alu_a(core, op);
+}
+
+// x86 inc/dec leave CF alone and compute AF the same way the SM83 computes H
+void GBCachedInterpreter::emit_inc_r8(Core& core, int r8) {
+  if (r8 == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.mov(dl, al);
+    code.inc(dl);
+    emit_defer_flags(core, FLAG_Z | FLAG_H, 0, FLAG_C);
+    emit_r16_address(core, 2);
+    emit_write_u8(core);
+    return;
+  }
+
+  code.inc(get_r8(core, r8, RegAccess::ReadWrite));
+  emit_defer_flags(core, FLAG_Z | FLAG_H, 0, FLAG_C);
+}
+
+void GBCachedInterpreter::emit_dec_r8(Core& core, int r8) {
+  if (r8 == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.mov(dl, al);
+    code.dec(dl);
+    emit_defer_flags(core, FLAG_Z | FLAG_H, FLAG_N, FLAG_C);
+    emit_r16_address(core, 2);
+    emit_write_u8(core);
+    return;
+  }
+
+  code.dec(get_r8(core, r8, RegAccess::ReadWrite));
+  emit_defer_flags(core, FLAG_Z | FLAG_H, FLAG_N, FLAG_C);
+}
+
+// INC/DEC r16 don't touch the guest flags, so pairs are carried through by hand
+void GBCachedInterpreter::emit_inc_r16(Core& core, int gp1) {
+  if (gp1 == 3) {
+    code.inc(get_sp(core, RegAccess::ReadWrite));
+    return;
+  }
+
+  code.add(get_r8(core, gp1 * 2 + 1, RegAccess::ReadWrite), 1);
+  code.adc(get_r8(core, gp1 * 2, RegAccess::ReadWrite), 0);
+}
+
+void GBCachedInterpreter::emit_dec_r16(Core& core, int gp1) {
+  if (gp1 == 3) {
+    code.dec(get_sp(core, RegAccess::ReadWrite));
+    return;
+  }
+
+  code.sub(get_r8(core, gp1 * 2 + 1, RegAccess::ReadWrite), 1);
+  code.sbb(get_r8(core, gp1 * 2, RegAccess::ReadWrite), 0);
+}
+
+// Rotate/shift `op` (RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL) on reg. x86
+// rotates leave ZF alone, so the carry is saved in al while reg is tested,
+// and put back into CF with bt, which leaves ZF alone in turn
+void GBCachedInterpreter::emit_shift(Core& core, int op, Xbyak::Reg8 reg) {
+  switch (op) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+      if (op == 2 || op == 3) {
+        emit_load_carry(core);
+      }
+      if (op == 0) {
+        code.rol(reg, 1);
+      } else if (op == 1) {
+        code.ror(reg, 1);
+      } else if (op == 2) {
+        code.rcl(reg, 1);
+      } else {
+        code.rcr(reg, 1);
+      }
+      if (live_flags & (FLAG_Z | FLAG_C)) {
+        code.setc(al);
+        code.test(reg, reg);
+        code.bt(eax, 0);
+      }
+      emit_defer_flags(core, FLAG_Z | FLAG_C, 0, 0);
+      break;
+    case 4:
+      code.shl(reg, 1);
+      emit_defer_flags(core, FLAG_Z | FLAG_C, 0, 0);
+      break;
+    case 5:
+      code.sar(reg, 1);
+      emit_defer_flags(core, FLAG_Z | FLAG_C, 0, 0);
+      break;
+    case 6:
+      code.rol(reg, 4);
+      code.test(reg, reg);
+      emit_defer_flags(core, FLAG_Z, 0, 0);
+      break;
+    case 7:
+      code.shr(reg, 1);
+      emit_defer_flags(core, FLAG_Z | FLAG_C, 0, 0);
+      break;
+    default:
+      PANIC("Invalid shift operation: {}\n", op);
+  }
+}
+
+void GBCachedInterpreter::emit_shift_r8(Core& core, int op, int r8) {
+  if (r8 == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.mov(dl, al);
+    emit_shift(core, op, dl);
+    emit_r16_address(core, 2);
+    emit_write_u8(core);
+    return;
+  }
+
+  emit_shift(core, op, get_r8(core, r8, RegAccess::ReadWrite));
+}
+
+void GBCachedInterpreter::emit_bit_r8(Core& core, int bit, int r8) {
+  if (r8 == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.test(al, 1 << bit);
+  } else {
+    code.test(get_r8(core, r8, RegAccess::Read), 1 << bit);
+  }
+  emit_defer_flags(core, FLAG_Z, FLAG_H, FLAG_C);
+}
+
+// RES/SET, with btr/bts on the 32-bit register holding the operand, as those
+// have no 8-bit form. Guest flags aren't touched
+void GBCachedInterpreter::emit_res_set_r8(Core& core, int bit, int r8,
+                                          bool set) {
+  auto apply = [&](const Xbyak::Reg& reg) {
+    if (set) {
+      code.bts(reg, bit);
+    } else {
+      code.btr(reg, bit);
+    }
+  };
+
+  if (r8 == 6) {
+    emit_r16_address(core, 2);
+    emit_read_u8(core);
+    code.movzx(edx, al);
+    apply(edx);
+    emit_r16_address(core, 2);
+    emit_write_u8(core);
+    return;
+  }
+
+  apply(get_r8(core, r8, RegAccess::ReadWrite).cvt32());
+}
+
+// Decrements SP by 2 and stores hi:lo there, low byte first. The stack is in
+// WRAM or HRAM nearly always, with SP even, so when both bytes are on a page
+// in Core::write_pages they're stored directly. Anything else (HRAM, pages
+// with code, MMIO, a word crossing a page) goes a byte at a time through
+// emit_write_u8
+void GBCachedInterpreter::emit_push_u16(Core& core, Xbyak::Reg8 lo,
+                                        Xbyak::Reg8 hi) {
+  Xbyak::Label slow, done;
+  const auto sp = get_sp(core, RegAccess::ReadWrite);
+  code.sub(sp, 2);
+
+  code.movzx(eax, sp);
+  code.cmp(al, 0xFF);
+  code.je(slow);
+  code.mov(edi, eax);
+  code.shr(edi, 8);
+  code.mov(rdi,
+           qword[SAVED2 + rdi * 8 + get_offset(core, core.write_pages.data())]);
+  code.test(rdi, rdi);
+  code.jz(slow);
+  code.movzx(eax, al);
+  code.mov(byte[rdi + rax], lo);
+  code.mov(byte[rdi + rax + 1], hi);
+  code.jmp(done, code.T_NEAR);
+
+  code.L(slow);
+  code.movzx(eax, sp);
+  code.mov(dl, lo);
+  emit_write_u8(core);
+  code.movzx(eax, sp);
+  code.inc(ax);
+  code.mov(dl, hi);
+  emit_write_u8(core);
+  code.L(done);
+}
+
+// Loads hi:lo from SP, low byte first, and increments SP by 2. Same fast path
+// as emit_push_u16, through Core::read_pages
+void GBCachedInterpreter::emit_pop_u16(Core& core, Xbyak::Reg8 lo,
+                                       Xbyak::Reg8 hi) {
+  Xbyak::Label slow, done;
+  const auto sp = get_sp(core, RegAccess::ReadWrite);
+
+  code.movzx(eax, sp);
+  code.cmp(al, 0xFF);
+  code.je(slow);
+  code.mov(edx, eax);
+  code.shr(edx, 8);
+  code.mov(rdx,
+           qword[SAVED2 + rdx * 8 + get_offset(core, core.read_pages.data())]);
+  code.test(rdx, rdx);
+  code.jz(slow);
+  code.movzx(eax, al);
+  code.mov(lo, byte[rdx + rax]);
+  code.mov(hi, byte[rdx + rax + 1]);
+  code.jmp(done, code.T_NEAR);
+
+  code.L(slow);
+  code.movzx(eax, sp);
+  emit_read_u8(core);
+  code.mov(lo, al);
+  code.movzx(eax, sp);
+  code.inc(ax);
+  emit_read_u8(core);
+  code.mov(hi, al);
+  code.L(done);
+  code.add(sp, 2);
+}
+
+// PUSH BC/DE/HL/AF. The low nibble of F is already 0, see emit_pop_r16
+void GBCachedInterpreter::emit_push_r16(Core& core, int gp3) {
+  if (gp3 != 3) {
+    emit_push_u16(core, get_r8(core, gp3 * 2 + 1, RegAccess::Read),
+                  get_r8(core, gp3 * 2, RegAccess::Read));
+    return;
+  }
+
+  const auto f = byte[SAVED2 + get_offset(core, &core.regs[Regs::AF])];
+  emit_flush_flags(core);
+  code.mov(cl, f);
+  emit_push_u16(core, cl, get_r8(core, 7, RegAccess::Read));
+}
+
+// POP BC/DE/HL/AF. POP AF stores F as popped, dropping any pending flags. Its
+// low nibble always reads as 0, as in GBInterpreter::pop_r16
+void GBCachedInterpreter::emit_pop_r16(Core& core, int gp3) {
+  if (gp3 != 3) {
+    emit_pop_u16(core, get_r8(core, gp3 * 2 + 1, RegAccess::Write),
+                 get_r8(core, gp3 * 2, RegAccess::Write));
+    return;
+  }
+
+  pending_flags = {};
+  emit_pop_u16(core, cl, get_r8(core, 7, RegAccess::Write));
+  code.and_(cl, 0xF0);
+  code.mov(byte[SAVED2 + get_offset(core, &core.regs[Regs::AF])], cl);
+}
+
+// Return address of CALL or RST
+void GBCachedInterpreter::emit_push_imm(Core& core, uint16_t value) {
+  emit_flush_flags(core);
+  code.mov(ecx, value);
+  emit_push_u16(core, cl, ch);
+}
+
+// RET / RETI, popping straight into core.pc
+void GBCachedInterpreter::emit_ret(Core& core, bool reti) {
+  emit_flush_flags(core);
+  emit_pop_u16(core, cl, ch);
+  code.mov(word[SAVED2 + get_offset(core, &core.pc)], cx);
+  if (reti) {
+    code.mov(byte[SAVED2 + get_offset(core, &core.IME)], 1);
+  }
+}
+
+// Where every block exit ends up unless it takes a link, with the cycles taken
+// so far in SAVED1 and core.pc pointing at the next block. Runs that block
+// right away if it has been compiled, without going back through run_block.
+// Returns once the cycle budget is used up, an interrupt is pending, the CPU
+// halts or EI is waiting to take effect, for run_frame to take care of. Also
+// returns whenever run_block has more to do than running the block: compiling
+// it, promoting it to a trace, linking the exit that just got us here, or
+// counting block stats
+void GBCachedInterpreter::emit_dispatcher(Core& core) {
+  static const Block probe;
+  auto block_offset = [](const auto& member) {
+    return (uintptr_t)&member - (uintptr_t)&probe;
+  };
+  Xbyak::Label lookup, enter, leave;
+  dispatcher = code.getCurr();
+
+  code.cmp(SAVED1, qword[SAVED2 + get_offset(core, &core.cycle_budget)]);
+  code.jge(leave, Xbyak::CodeGenerator::T_NEAR);
+
+  code.mov(rax, (uintptr_t)&pending_link);
+  code.cmp(qword[rax], 0);
+  code.jne(leave, Xbyak::CodeGenerator::T_NEAR);
+  // inline caches that already point somewhere are left alone, so that
+  // indirect exits going to many places don't come back here every time
+  code.mov(rax, (uintptr_t)&pending_indirect);
+  code.mov(rdx, qword[rax]);
+  code.test(rdx, rdx);
+  code.jz(lookup);
+  code.cmp(dword[rdx - 4], 0);
+  code.je(leave, Xbyak::CodeGenerator::T_NEAR);
+  code.mov(qword[rax], 0);
+
+  code.L(lookup);
+  code.mov(rax, (uintptr_t)&block_stats_enabled);
+  code.cmp(byte[rax], 0);
+  code.jne(leave, Xbyak::CodeGenerator::T_NEAR);
+  code.cmp(byte[SAVED2 + get_offset(core, &core.HALT)], 0);
+  code.jne(leave, Xbyak::CodeGenerator::T_NEAR);
+  code.cmp(byte[SAVED2 + get_offset(core, &core.req_IME)], 0);
+  code.jne(leave, Xbyak::CodeGenerator::T_NEAR);
+  Xbyak::Label no_interrupt;
+  code.cmp(byte[SAVED2 + get_offset(core, &core.IME)], 0);
+  code.je(no_interrupt);
+  code.mov(al, byte[SAVED2 + get_offset(core, &core.IE)]);
+  code.and_(al, byte[SAVED2 + get_offset(core, &core.IF)]);
+  code.test(al, 0x1F);
+  code.jnz(leave, Xbyak::CodeGenerator::T_NEAR);
+  code.L(no_interrupt);
+
+  // rdi = &block_page_table[pc >> PAGE_SHIFT][pc & (PAGE_SIZE - 1)]
+  code.movzx(eax, word[SAVED2 + get_offset(core, &core.pc)]);
+  code.mov(edx, eax);
+  code.shr(edx, PAGE_SHIFT);
+  code.mov(rdi, (uintptr_t)block_page_table);
+  code.mov(rdi, qword[rdi + rdx * 8]);
+  code.test(rdi, rdi);
+  code.jz(leave, Xbyak::CodeGenerator::T_NEAR);
+  code.mov(edx, eax);
+  code.and_(edx, PAGE_SIZE - 1);
+  code.imul(edx, edx, sizeof(Block));
+  code.add(rdi, rdx);
+  code.cmp(qword[rdi + block_offset(probe.fp)], 0);
+  code.je(leave, Xbyak::CodeGenerator::T_NEAR);
+
+  // blocks in cartridge ROM count their dispatches towards becoming a trace,
+  // see run_block
+  code.cmp(byte[rdi + block_offset(probe.trace)], 0);
+  code.jne(enter);
+  code.cmp(eax, 0x8000);
+  code.jae(enter);
+  Xbyak::Label count;
+  code.cmp(eax, 0x100);
+  code.jae(count);
+  code.cmp(byte[SAVED2 + get_offset(core, &core.bootrom_enabled)], 0);
+  code.jne(enter);
+  code.L(count);
+  code.mov(ecx, dword[rdi + block_offset(probe.dispatches)]);
+  code.inc(ecx);
+  code.cmp(ecx, TRACE_THRESHOLD);
+  code.jae(leave);
+  code.mov(dword[rdi + block_offset(probe.dispatches)], ecx);
+
+  code.L(enter);
+  code.jmp(qword[rdi + block_offset(probe.body)]);
+
+  code.L(leave);
+  code.mov(rax, SAVED1);
+  emit_epilogue(core);
+}
+
+// Jumps to exit unless a link may be taken: we are still within the cycle
+// budget, and there is no interrupt for run_frame to service. The block may
+// have enabled interrupts with one pending, which the dispatcher would catch
+// but a chain of linked blocks wouldn't
+void GBCachedInterpreter::emit_link_guard(Core& core, Xbyak::Label& exit) {
+  Xbyak::Label no_interrupt;
+  code.cmp(SAVED1, qword[SAVED2 + get_offset(core, &core.cycle_budget)]);
+  code.jge(exit, Xbyak::CodeGenerator::T_NEAR);
+  code.cmp(byte[SAVED2 + get_offset(core, &core.IME)], 0);
+  code.je(no_interrupt);
+  code.mov(al, byte[SAVED2 + get_offset(core, &core.IE)]);
+  code.and_(al, byte[SAVED2 + get_offset(core, &core.IF)]);
+  code.test(al, 0x1F);
+  code.jnz(exit, Xbyak::CodeGenerator::T_NEAR);
+  code.L(no_interrupt);
+}
+
+// Ends a block. Linkable exits may later be patched by link_block to jump
+// straight into the next block, as long as emit_link_guard lets them. Until
+// then, their jmp has a displacement of 0 and falls through to a stub that
+// tells decode_execute where to patch. Either way, the exit then goes on to
+// the dispatcher
+void GBCachedInterpreter::emit_block_exit(Core& core, bool linkable) {
+  Xbyak::Label exit;
+
+  if (linkable) {
+    emit_link_guard(core, exit);
+
+    code.db(0xE9); // jmp rel32
+    code.dd(0);
+    auto* link = code.getCurr<uint8_t*>();
+
+    code.mov(rax, (uintptr_t)&pending_link);
+    code.mov(rdx, (uintptr_t)link);
+    code.mov(qword[rax], rdx);
+  }
+
+  code.L(exit);
+  code.jmp(dispatcher, Xbyak::CodeGenerator::T_NEAR);
+}
+
+// pc the inline cache of an indirect exit compares against, as an imm32 this
+// far before its link: mov edx, imm32; cmp eax, edx; jne rel8; jmp rel32
+constexpr int INDIRECT_GUESS_OFFSET = 4 + 2 + 2 + 5;
+
+// Ends a block whose next pc is only known at run time. Returns first try the
+// shadow return-address stack (see emit_push_return). Then, an inline cache
+// compares core.pc against the pc this exit went to last time, and if it
+// matches, takes a link to that block just like emit_block_exit. On a miss,
+// the stub tells run_block to point the cache at wherever core.pc went instead
+void GBCachedInterpreter::emit_indirect_exit(Core& core, IndirectExit kind) {
+  Xbyak::Label cache, miss, leave;
+  const auto pc = word[SAVED2 + get_offset(core, &core.pc)];
+
+  if (kind == IndirectExit::ReturnFromInterrupt) {
+    // left to run_frame, which would service it right after RETI
+    code.mov(al, byte[SAVED2 + get_offset(core, &core.IE)]);
+    code.and_(al, byte[SAVED2 + get_offset(core, &core.IF)]);
+    code.test(al, 0x1F);
+    code.jnz(leave, Xbyak::CodeGenerator::T_NEAR);
+  }
+
+  if (kind == IndirectExit::Return) {
+    code.mov(rdi, (uintptr_t)&return_stack_top);
+    code.mov(eax, dword[rdi]);
+    code.dec(dword[rdi]);
+    code.and_(eax, RETURN_STACK_SIZE - 1);
+    code.shl(eax, 4);
+    code.mov(rdi, (uintptr_t)return_stack.data());
+    code.mov(rdx, qword[rdi + rax + offsetof(ReturnPrediction, landing)]);
+    code.test(rdx, rdx);
+    code.jz(cache);
+    code.movzx(ecx, word[rdi + rax + offsetof(ReturnPrediction, pc)]);
+    code.cmp(cx, pc);
+    code.jne(cache);
+    code.jmp(rdx);
+  }
+
+  code.L(cache);
+  emit_link_guard(core, leave);
+  code.movzx(eax, pc);
+  code.mov(edx, 0);
+  const auto* guess = code.getCurr<uint8_t*>() - sizeof(uint32_t);
+  code.cmp(eax, edx);
+  code.jne(miss, Xbyak::CodeGenerator::T_SHORT);
+  code.db(0xE9); // jmp rel32
+  code.dd(0);
+  auto* link = code.getCurr<uint8_t*>();
+  if (link - guess != INDIRECT_GUESS_OFFSET) {
+    PANIC("Unexpected inline cache layout\n");
+  }
+
+  code.L(miss);
+  code.mov(rax, (uintptr_t)&pending_indirect);
+  code.mov(rdx, (uintptr_t)link);
+  code.mov(qword[rax], rdx);
+
+  code.L(leave);
+  code.jmp(dispatcher, Xbyak::CodeGenerator::T_NEAR);
+}
+
+// Pushes return_pc onto the shadow return-address stack, after the CALL or RST
+// that pushed it onto the guest stack. landing is where a RET to it continues,
+// a linkable exit emitted after the rest of the block
+void GBCachedInterpreter::emit_push_return(Core&, uint16_t return_pc,
+                                           Xbyak::Label& landing) {
+  static_assert(sizeof(ReturnPrediction) == 16);
+  code.mov(rdi, (uintptr_t)&return_stack_top);
+  code.mov(eax, dword[rdi]);
+  code.inc(eax);
+  code.mov(dword[rdi], eax);
+  code.and_(eax, RETURN_STACK_SIZE - 1);
+  code.shl(eax, 4);
+  code.mov(rdi, (uintptr_t)return_stack.data());
+  code.mov(word[rdi + rax + offsetof(ReturnPrediction, pc)], return_pc);
+  code.mov(rdx, landing);
+  code.mov(qword[rdi + rax + offsetof(ReturnPrediction, landing)], rdx);
+}
+
+// Stores pc to core.pc, unless it's known to be there already
+void GBCachedInterpreter::emit_sync_pc(Core& core, uint16_t pc) {
+  if (synced_pc != pc) {
+    code.mov(word[SAVED2 + get_offset(core, &core.pc)], pc);
+    synced_pc = pc;
+  }
+}
+
+// Leaves the block from the middle, with static_cycles taken so far, at exit_pc
+// or wherever core.pc already points, skipping idle iterations if exit_pc
+// starts an idle loop and idle_skip is set. The rest of the block still sees
+// the same pending flags, loaded guest registers and core.pc as if the exit
+// wasn't there
+void GBCachedInterpreter::emit_side_exit(Core& core, int static_cycles,
+                                         bool linkable, int32_t exit_pc,
+                                         bool idle_skip) {
+  const auto flags = pending_flags;
+  const auto regs = guest_regs;
+  const auto pc = synced_pc;
+  emit_flush_flags(core);
+  emit_writeback_regs(core);
+  if (exit_pc != PC_DYNAMIC) {
+    emit_sync_pc(core, exit_pc);
+  }
+  if (idle_skip) {
+    emit_idle_skip(core, static_cycles);
+  }
+  pending_flags = flags;
+  guest_regs = regs;
+  synced_pc = pc;
+  code.add(SAVED1, static_cycles);
+  emit_block_exit(core, linkable);
+}
+
+// Leaves the block early at exit_pc, once the cycles taken so far reach the
+// cycle budget
+void GBCachedInterpreter::emit_cycle_check(Core& core, int static_cycles,
+                                           uint16_t exit_pc) {
+  Xbyak::Label next;
+  code.lea(rax, ptr[SAVED1 + static_cycles]);
+  code.cmp(rax, qword[SAVED2 + get_offset(core, &core.cycle_budget)]);
+  code.jl(next, Xbyak::CodeGenerator::T_NEAR);
+  emit_side_exit(core, static_cycles, false, exit_pc);
+  code.L(next);
+}
+
+// Jumps to skip unless branch condition `condition` (NZ, Z, NC, C) holds. The
+// flag it depends on may still be pending, which saves storing it to F first,
+// or even be known at compile time
+void GBCachedInterpreter::emit_skip_unless(Core& core, int condition,
+                                           Xbyak::Label& skip) {
+  const auto& pending = pending_flags;
+  const uint8_t flag = condition >> 1 ? FLAG_C : FLAG_Z;
+  const bool if_set = condition & 1;
+
+  if (pending.from_host & flag) {
+    code.test(cl, host_flag_bits(flag));
+  } else if ((pending.set | pending.clear) & flag) {
+    if (bool(pending.set & flag) != if_set) {
+      code.jmp(skip, Xbyak::CodeGenerator::T_NEAR);
+    }
+    return;
+  } else {
+    code.test(byte[SAVED2 + get_offset(core, &core.regs[Regs::AF])], flag);
+  }
+
+  if (if_set) {
+    code.jz(skip, Xbyak::CodeGenerator::T_NEAR);
+  } else {
+    code.jnz(skip, Xbyak::CodeGenerator::T_NEAR);
+  }
+}
+
+// Takes a linkable side exit if the branch condition holds, and counts which
+// way it went into the branch's profile, if it has one, for traces to follow
+void GBCachedInterpreter::emit_conditional_exit(Core& core,
+                                                const IRInst& inst) {
+  Xbyak::Label stay;
+  emit_skip_unless(core, inst.a, stay);
+  if (inst.profile) {
+    code.mov(rax, (uintptr_t)&inst.profile->taken);
+    code.inc(dword[rax]);
+  }
+  emit_side_exit(core, inst.cycles + inst.b, true, inst.imm, inst.idle_skip);
+
+  code.L(stay);
+  if (inst.profile) {
+    code.mov(rax, (uintptr_t)&inst.profile->not_taken);
+    code.inc(dword[rax]);
+  }
+}
+
+// Whether the code at start is a loop that polls memory until it changes, and
+// does nothing else: it loads A from an address that only changes at the
+// events Core::cycle_budget stops at (PPU mode changes, timer overflows) or in
+// interrupt handlers, combines A with immediates or registers the loop doesn't
+// write into A and F, and branches back to start. Every iteration then does
+// exactly the same thing until the next event
+bool GBCachedInterpreter::is_idle_loop(Core& core, uint16_t start) {
+  uint16_t pc = start;
+  uint16_t addr;
+  auto opcode = fetch_u8(core, pc++);
+  if (opcode == 0b1111'0000) {
+    addr = 0xFF00 + fetch_u8(core, pc++);
+  } else if (opcode == 0b1111'1010) {
+    addr = fetch_u16(core, pc);
+    pc += 2;
+  } else {
+    return false;
+  }
+
+  // WRAM, HRAM, JOYP, IF, STAT, LY
+  if (!in_between(0xC000, 0xDFFF, addr) && !in_between(0xFF80, 0xFFFE, addr) &&
+      addr != 0xFF00 && addr != 0xFF0F && addr != 0xFF41 && addr != 0xFF44) {
+    return false;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    opcode = fetch_u8(core, pc++);
+    // ADC and SBC would depend on the carry of the last iteration
+    const auto alu_op = opcode >> 3 & 0x7;
+    const bool uses_carry = alu_op == 1 || alu_op == 3;
+
+    if (opcode == 0x00 ||
+        (opcode >> 6 == 0b10 && (opcode & 0x7) != 6 && !uses_carry)) {
+      // NOP, ALU A, r8
+
+    } else if (opcode >> 6 == 0b11 && (opcode & 0x7) == 0b110 && !uses_carry) {
+      // ALU A, u8
+      pc++;
+
+    } else if (opcode == 0xCB) {
+      // BIT b, r8
+      const auto second = fetch_u8(core, pc++);
+      if (second >> 6 != 0b01 || (second & 0x7) == 6) {
+        return false;
+      }
+
+    } else if ((opcode >> 5) == 0b001 && (opcode & 0x07) == 0b000) {
+      // JR cc
+      return (uint16_t)(pc + 1 + (int8_t)fetch_u8(core, pc)) == start;
+
+    } else if (opcode >> 5 == 0b110 && (opcode & 0x7) == 0b010) {
+      // JP cc
+      return fetch_u16(core, pc) == start;
+
+    } else {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+// On the exit an idle loop takes to go around again, adds the cycles of every
+// further iteration it would run before the cycle budget is used up. The exit
+// then returns to run_frame, right where spinning through those iterations
+// would have. iteration_cycles include the taken branch. After a store that
+// moved the next event the budget is 0 (see Core::moves_next_event), so
+// nothing is skipped until run_frame has computed it again
+void GBCachedInterpreter::emit_idle_skip(Core& core, int iteration_cycles) {
+  Xbyak::Label done;
+  // cycles left once this iteration is accounted for
+  code.mov(rax, qword[SAVED2 + get_offset(core, &core.cycle_budget)]);
+  code.sub(rax, SAVED1);
+  code.sub(rax, iteration_cycles);
+  code.jle(done);
+
+  // rounded up to whole iterations
+  code.add(rax, iteration_cycles - 1);
+  code.xor_(edx, edx);
+  code.mov(edi, iteration_cycles);
+  code.div(rdi);
+  code.imul(rax, rax, iteration_cycles);
+  code.add(SAVED1, rax);
+
+  code.L(done);
+}
+
+// Whether the code at start is a loop that copies a byte from one pointer
+// register to another, or stores A through one, steps the pointers, and
+// decrements a counter until it reaches 0, branching back to start. Every
+// iteration then does the same thing to the next byte, see run_bulk_loop.
+// An 8-bit counter sets Z itself. BC is tested with LD A, B / OR C (or
+// LD A, C / OR B), which overwrites A, so only copies can count with it
+bool GBCachedInterpreter::is_bulk_loop(Core& core, uint16_t start,
+                                       BulkLoop& loop) {
+  uint16_t pc = start;
+  int cycles = 0;
+  bool loaded = false;
+  bool stored = false;
+  bool counted = false;
+  // Z reflects whether the counter reached 0
+  bool tested = false;
+  loop = {};
+
+  for (int i = 0; i < 8; i++) {
+    const auto opcode = fetch_u8(core, pc++);
+    const int gp = opcode >> 4 & 0b11;
+    cycles += regular_instr_timing[opcode] * 4;
+
+    if ((opcode & 0xCF) == 0x0A) {
+      // LD A, (BC/DE/HL+/HL-)
+      if (loaded || stored) {
+        return false;
+      }
+      loop.src = std::min(gp, 2);
+      loop.src_step = gp == 2 ? 1 : gp == 3 ? -1 : 0;
+      loaded = true;
+
+    } else if ((opcode & 0xCF) == 0x02 || opcode == 0x77) {
+      // LD (BC/DE/HL+/HL-), A / LD (HL), A
+      if (stored) {
+        return false;
+      }
+      loop.dst = opcode == 0x77 ? 2 : std::min(gp, 2);
+      loop.dst_step = opcode == 0x77 ? 0 : gp == 2 ? 1 : gp == 3 ? -1 : 0;
+      stored = true;
+
+    } else if ((opcode & 0xC7) == 0x03 && gp != 3) {
+      // INC/DEC BC/DE/HL, stepping a pointer once it has been used
+      const int step = opcode & 0x08 ? -1 : 1;
+      if (stored && gp == loop.dst) {
+        loop.dst_step += step;
+      } else if (loaded && gp == loop.src) {
+        loop.src_step += step;
+      } else if (gp == 0 && step == -1 && !counted) {
+        loop.counter = -1;
+        counted = true;
+      } else {
+        return false;
+      }
+
+    } else if ((opcode & 0xC7) == 0x05 && opcode != 0x35 && opcode != 0x3D) {
+      // DEC r8, other than (HL) and A
+      if (counted) {
+        return false;
+      }
+      loop.counter = opcode >> 3 & 0x7;
+      counted = true;
+      tested = true;
+
+    } else if ((opcode == 0x78 || opcode == 0x79) && counted &&
+               loop.counter == -1) {
+      // LD A, B / OR C, LD A, C / OR B
+      const auto second = fetch_u8(core, pc++);
+      if (second != (opcode == 0x78 ? 0xB1 : 0xB0)) {
+        return false;
+      }
+      cycles += regular_instr_timing[second] * 4;
+      tested = true;
+
+    } else if (opcode == 0x20 || opcode == 0xC2) {
+      // JR NZ / JP NZ, which take 4 more cycles to go around again
+      const uint16_t target = opcode == 0x20
+                                  ? pc + 1 + (int8_t)fetch_u8(core, pc)
+                                  : fetch_u16(core, pc);
+      if (target != start || !stored || !tested ||
+          (loop.counter == -1 && !loaded)) {
+        return false;
+      }
+      // pointers and counter are separate registers, and pointers move by at
+      // most one byte per iteration
+      const int counter_gp = loop.counter == -1 ? 0 : loop.counter / 2;
+      if ((loaded && (loop.src == loop.dst || loop.src == counter_gp)) ||
+          loop.dst == counter_gp || std::abs(loop.src_step) > 1 ||
+          std::abs(loop.dst_step) > 1) {
+        return false;
+      }
+      loop.cycles = cycles + 4;
+      return true;
+
+    } else {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+// Bytes from addr to the end of its page, in the direction step moves it
+static int64_t page_run(uint16_t addr, int step) {
+  if (step > 0) {
+    return 0x100 - (addr & 0xFF);
+  } else if (step < 0) {
+    return (addr & 0xFF) + 1;
+  }
+  return INT64_MAX;
+}
+
+// Runs iterations of a copy or fill loop at once, a page at a time, for as long
+// as they only access pages in Core::read_pages and Core::write_pages and fit
+// in cycles_left, and returns the cycles they took. The iteration that ends
+// the loop, or uses up the cycle budget, is always left to the block, so that
+// it's the block that leaves A and F, and takes the branch
+static int64_t run_bulk_loop(Core& core, uint64_t packed, int64_t cycles_left) {
+  const auto loop = std::bit_cast<BulkLoop>(packed);
+  auto r16 = [&](int gp1) -> uint16_t& { return core.regs[gp1 + 1]; };
+  const bool fill = loop.src < 0;
+
+  // an 8-bit counter is the high byte of its pair for B, D and H
+  auto& counter = r16(loop.counter < 0 ? 0 : loop.counter / 2);
+  const int shift = loop.counter >= 0 && loop.counter % 2 == 0 ? 8 : 0;
+  int64_t count = loop.counter < 0 ? counter : counter >> shift & 0xFF;
+  if (count == 0) {
+    // decrementing wraps around
+    count = loop.counter < 0 ? 0x10000 : 0x100;
+  }
+  const auto iterations =
+      std::min(count - 1, (cycles_left - 1) / (int64_t)loop.cycles);
+
+  uint16_t src = fill ? 0 : r16(loop.src);
+  uint16_t dst = r16(loop.dst);
+  const uint8_t value = core.regs[Regs::AF] >> 8;
+  int64_t done = 0;
+  while (done < iterations) {
+    auto* dst_page = core.write_pages[dst >> 8];
+    const auto* src_page = fill ? nullptr : core.read_pages[src >> 8];
+    if (!dst_page || (!fill && !src_page)) {
+      break;
+    }
+
+    auto chunk = std::min(iterations - done, page_run(dst, loop.dst_step));
+    auto* to = dst_page + (dst & 0xFF);
+    if (fill) {
+      if (loop.dst_step) {
+        memset(loop.dst_step > 0 ? to : to - chunk + 1, value, chunk);
+      } else {
+        *to = value;
+      }
+    } else {
+      chunk = std::min(chunk, page_run(src, loop.src_step));
+      const auto* from = src_page + (src & 0xFF);
+      if (loop.src_step == 1 && loop.dst_step == 1 &&
+          (to <= from || to >= from + chunk)) {
+        // same as copying a byte at a time
+        memmove(to, from, chunk);
+      } else {
+        for (int64_t i = 0; i < chunk; i++) {
+          to[i * loop.dst_step] = from[i * loop.src_step];
+        }
+      }
+    }
+
+    src += (uint16_t)(chunk * loop.src_step);
+    dst += (uint16_t)(chunk * loop.dst_step);
+    done += chunk;
+  }
+
+  if (loop.counter < 0) {
+    counter -= done;
+  } else {
+    const uint8_t left = (counter >> shift) - done;
+    counter = (counter & ~(0xFF << shift)) | left << shift;
+  }
+  r16(loop.dst) = dst;
+  if (!fill) {
+    r16(loop.src) = src;
+  }
+  return done * loop.cycles;
+}
+
+// Runs a recognized copy or fill loop in bulk at the start of its block, see
+// run_bulk_loop. The cycles it took are added to SAVED1
+void GBCachedInterpreter::emit_bulk_loop(Core& core, const BulkLoop& loop) {
+  emit_flush_flags(core);
+  emit_writeback_regs(core);
+  code.mov(PARAM3, qword[SAVED2 + get_offset(core, &core.cycle_budget)]);
+  code.sub(PARAM3, SAVED1);
+  code.mov(PARAM2, std::bit_cast<uint64_t>(loop));
+  code.mov(PARAM1, (uintptr_t)&core);
+  code.mov(rax, (uintptr_t)run_bulk_loop);
+  code.call(rax);
+  code.add(SAVED1, rax);
+  guest_regs = {};
+}
+
+void GBCachedInterpreter::link_block(uint8_t* link, Block& target) {
+  auto displacement = (int32_t)(target.body - link);
+  memcpy(link - sizeof(displacement), &displacement, sizeof(displacement));
+  if (target.links.empty() && in_between(0x4000, 0x7FFF, target.start)) {
+    banked_link_targets.push_back(&target);
+  }
+  target.links.push_back(link);
+}
+
+// Points the inline cache of an indirect exit at target. Links stay in the
+// list of every block the cache pointed at before, unlinking any of those just
+// sends the exit through its stub once more
+void GBCachedInterpreter::link_indirect(uint8_t* link, Block& target) {
+  const uint32_t pc = target.start;
+  memcpy(link - INDIRECT_GUESS_OFFSET, &pc, sizeof(pc));
+  if (std::find(target.links.begin(), target.links.end(), link) !=
+      target.links.end()) {
+    auto displacement = (int32_t)(target.body - link);
+    memcpy(link - sizeof(displacement), &displacement, sizeof(displacement));
+    return;
+  }
+  link_block(link, target);
+}
+
+// Point every link into this block back at its exit stub
+void GBCachedInterpreter::unlink_block(Block& block) {
+  for (auto* link : block.links) {
+    memset(link - sizeof(int32_t), 0, sizeof(int32_t));
+  }
+  block.links.clear();
 }
 
-block_fp GBCachedInterpreter::recompile_block(Core& core) {
-  check_emitted_cache();
+// next_pc of a fallback whose operands haven't been decoded yet
+static constexpr int32_t PC_PENDING = -2;
+
+// Guest code to compile. Cartridge ROM is read from the bank the block is
+// compiled for, which the compile thread can't rely on being mapped
+uint8_t GBCachedInterpreter::fetch_u8(Core& core, uint16_t addr) {
+  if (compile_in_rom && addr < 0x8000) {
+    return core.mbc.rom_read(compile_bank, addr);
+  }
+  return core.mem_read<uint8_t>(addr);
+}
+
+uint16_t GBCachedInterpreter::fetch_u16(Core& core, uint16_t addr) {
+  return fetch_u8(core, addr) | fetch_u8(core, addr + 1) << 8;
+}
 
-  auto emitted_function = (block_fp)code.getCurr();
-  auto dyn_pc = core.pc;
+// Compiles the block at start, in ROM bank `bank` if it's in 0x4000-0x7FFF,
+// and with the bootrom over 0x0000-0x00FF if bootrom_enabled. Both are taken
+// as of when the block was requested, as they may have changed by the time
+// the compile thread gets to it. Called with compile_mutex held, on either
+// thread
+void GBCachedInterpreter::recompile_block(Core& core, Block& block,
+                                          uint16_t start, uint32_t bank,
+                                          bool bootrom_enabled, bool trace) {
+  const bool stats = block_stats_enabled;
+  std::chrono::steady_clock::time_point compile_start;
+  if (stats) {
+    compile_start = std::chrono::steady_clock::now();
+  }
+  block.start = start;
+  auto dyn_pc = start;
   auto static_cycles_taken = 0;
   bool jump_emitted = false;
+  // whether the jump that ends this block always lands on the same pc, and
+  // where
+  bool static_jump = false;
+  uint16_t jump_target = 0;
+  // the block ends in a conditional branch, not taken if we get to its end
+  bool branch_emitted = false;
+  // cycles a branch that was just followed takes when taken, on top of the
+  // static timing of its instruction
+  int taken_cycles = 0;
+  // EI only takes effect once we're back in run_frame, so end the block there
+  bool ei_emitted = false;
+  // how the block ends if its last jump goes to a pc only known at run time
+  IndirectExit indirect = IndirectExit::None;
+  // cartridge ROM can't change under a running block, so blocks there may run
+  // on past the end of their page
+  const bool in_rom = in_cartridge_rom(block.start, bootrom_enabled);
+  int instructions = 0;
+  // whether the last instruction was a jump the trace followed
+  bool followed = false;
+  // jump targets the trace has followed, to stop once it loops
+  std::vector<uint16_t> trace_entries = {block.start};
+  compile_in_rom = in_rom;
+  compile_bank = bank;
+  compile_bootrom = bootrom_enabled;
+  // compiled as a regular block even once hot, as a trace could follow the
+  // loop's exit and side exit on every iteration instead
+  const bool idle_loop = is_idle_loop(core, block.start);
+  if (idle_loop) {
+    trace = false;
+  }
 
-  emit_prologue(core);
-  // SAVED1 will hold all dynamically emitted cycles
-  code.mov(SAVED1, 0);
-  // SAVED2 will hold a pointer to the core
-  code.mov(SAVED2, (uintptr_t)&core);
+  auto can_follow = [&](uint16_t target) {
+    return trace && in_cartridge_rom(target, bootrom_enabled) &&
+           !((target ^ block.start) >> 14) &&
+           std::find(trace_entries.begin(), trace_entries.end(), target) ==
+               trace_entries.end();
+  };
+  auto follow = [&](uint16_t target) {
+    trace_entries.push_back(target);
+    dyn_pc = target;
+    followed = true;
+  };
+  // Static jumps either continue the trace at their target, or end the block
+  auto static_jump_to = [&](uint16_t target) {
+    if (can_follow(target)) {
+      follow(target);
+    } else {
+      jump_emitted = true;
+      static_jump = true;
+      jump_target = target;
+    }
+  };
+  // Leaves the block at exit_pc if condition holds, extra_cycles on top of the
+  // static cycles so far
+  auto conditional_exit = [&](int condition, uint16_t exit_pc,
+                              int extra_cycles,
+                              BranchProfile* profile = nullptr) {
+    IRInst inst{IROp::ConditionalExit, condition, extra_cycles, exit_pc};
+    inst.next_pc = PC_PENDING;
+    inst.profile = profile;
+    inst.idle_skip = idle_loop && exit_pc == block.start;
+    ir.push_back(inst);
+  };
+  // JR cc and JP cc, taking extra_cycles more if taken. Regular blocks end
+  // here, with a linkable exit for either direction, and count which one the
+  // branch takes if they're in cartridge ROM. Traces continue along the more
+  // frequently taken direction, and side exit if the branch goes the other way
+  auto conditional_branch = [&](int condition, uint16_t branch_pc,
+                                uint16_t target, int extra_cycles) {
+    BranchProfile* profile = nullptr;
+    uint16_t likely = dyn_pc;
+    if (in_rom) {
+      profile = &branch_profiles[rom_key(branch_pc, bank)];
+      // counted by emitted code, which may be running on the other thread
+      const auto taken =
+          std::atomic_ref(profile->taken).load(std::memory_order_relaxed);
+      const auto not_taken =
+          std::atomic_ref(profile->not_taken).load(std::memory_order_relaxed);
+      likely = taken > not_taken ? target : dyn_pc;
+    }
+
+    if (!can_follow(likely)) {
+      conditional_exit(condition, target, extra_cycles,
+                       trace ? nullptr : profile);
+      branch_emitted = true;
+      return;
+    }
 
-  // For the functions we call, rax holds the additional cycles to add onto
-  // the static cycles we calculate. However, for certain functions (eg NOP)
-  // rax is not set to anything, which can cause problems!!
-  code.mov(rax, 0);
+    if (likely == target) {
+      // the opposite condition, NZ <-> Z and NC <-> C
+      conditional_exit(condition ^ 1, dyn_pc, 0);
+      taken_cycles = extra_cycles;
+    } else {
+      conditional_exit(condition, target, extra_cycles);
+    }
+    follow(likely);
+  };
+  // Fallbacks take core.pc right after the opcode, and leave it after the
+  // operands (filled in once those are decoded) unless they jump
+  auto fallback = [&](auto fn, int first = 0, int second = 0) {
+    IRInst inst{IROp::Fallback, first, second};
+    inst.fallback = (void*)fn;
+    inst.params = std::is_same_v<decltype(fn), no_params_fp>    ? 0
+                  : std::is_same_v<decltype(fn), one_params_fp> ? 1
+                                                                : 2;
+    inst.operand_pc = dyn_pc;
+    inst.next_pc = PC_PENDING;
+    ir.push_back(inst);
+  };
+  auto native = [&](IROp op, int a = 0, int b = 0, uint16_t imm = 0) {
+    IRInst inst{op, a, b, imm};
+    inst.next_pc = PC_PENDING;
+    ir.push_back(inst);
+  };
+  // CALL and RST, pushing return_pc onto both the guest stack and the shadow
+  // return-address stack, then jumping to target
+  auto call = [&](uint16_t return_pc, uint16_t target) {
+    IRInst push{IROp::PushImm};
+    push.imm = return_pc;
+    push.next_pc = return_pc;
+    ir.push_back(push);
+    IRInst inst{IROp::PushReturn};
+    inst.imm = return_pc;
+    inst.next_pc = PC_PENDING;
+    ir.push_back(inst);
+    static_jump_to(target);
+  };
+  // RET and RETI, the taken side of RET cc
+  auto ret = [&](bool reti) {
+    native(IROp::Ret, reti);
+    ir.back().operand_pc = dyn_pc;
+    jump_emitted = true;
+    indirect =
+        reti ? IndirectExit::ReturnFromInterrupt : IndirectExit::Return;
+  };
+
+  ir.clear();
+
+  BulkLoop bulk;
+  if (is_bulk_loop(core, block.start, bulk)) {
+    IRInst inst{IROp::BulkLoop};
+    inst.bulk = bulk;
+    inst.next_pc = block.start;
+    ir.push_back(inst);
+  }
 
   // At compile time, we know what static cycles to add onto the
   // PC. However, we still have to account for conditional cycles
 
   while (true) {
-    // PRINT("DYN PC: 0x{:04X}\n", dyn_pc);
     const auto initial_dyn_pc = dyn_pc;
-    const auto opcode = core.mem_read<uint8_t>(dyn_pc++);
-    code.add(dword[SAVED2 + get_offset(core, &core.pc)], 1);
+    const auto opcode = fetch_u8(core, dyn_pc++);
+    const auto first_inst = ir.size();
+    followed = false;
 
     if (opcode != 0xCB) {
       static_cycles_taken += regular_instr_timing[opcode] * 4;
@@ -81,383 +1753,1338 @@ block_fp GBCachedInterpreter::recompile_block(Core& core) {
     if (opcode == 0x00) {
 
     } else if (opcode == 0x10) {
-      code.add(dword[SAVED2 + get_offset(core, &core.pc)], 1);
       dyn_pc += 1;
 
     } else if (opcode == 0b0000'1000) {
-      // PANIC("42!\n");
-      emit_fallback_no_params(GBInterpreter::ld_u16_sp, core);
+      fallback(GBInterpreter::ld_u16_sp);
       dyn_pc += 2;
 
     } else if (opcode == 0b0001'1000) {
-      // PANIC("41!\n");
-      emit_fallback_no_params(GBInterpreter::jr_unconditional, core);
-      jump_emitted = true;
+      dyn_pc++;
+      static_jump_to(dyn_pc + (int8_t)fetch_u8(core, dyn_pc - 1));
 
     } else if (opcode == 0b1110'1010) {
-      // PANIC("40!\n");
-      emit_fallback_no_params(GBInterpreter::ld_u16_a, core);
+      native(IROp::LdAddrA, 0, 0, fetch_u16(core, dyn_pc));
       dyn_pc += 2;
 
     } else if ((opcode >> 5) == 0b001 && (opcode & 0x07) == 0b000) {
-      emit_fallback_one_params(GBInterpreter::jr_conditional, core,
-                               opcode >> 3 & 0b11);
-      jump_emitted = true;
+      dyn_pc++;
+      conditional_branch(opcode >> 3 & 0b11, initial_dyn_pc,
+                         dyn_pc + (int8_t)fetch_u8(core, dyn_pc - 1), 4);
 
     } else if ((opcode & 0xC0) == 0 && (opcode & 0x0f) == 0x1) {
-      emit_fallback_one_params(GBInterpreter::ld_r16_u16, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::LdR16Imm, opcode >> 4 & 0b11, 0,
+             fetch_u16(core, dyn_pc));
       dyn_pc += 2;
 
     } else if ((opcode & 0xC0) == 0 && (opcode & 0x0f) == 0b1001) {
-      // PANIC("39!\n");
-      emit_fallback_one_params(GBInterpreter::add_hl_r16, core,
-                               opcode >> 4 & 0b11);
+      fallback(GBInterpreter::add_hl_r16, opcode >> 4 & 0b11);
 
     } else if ((opcode & 0xC0) == 0 && (opcode & 0x0f) == 0b0010) {
-      emit_fallback_one_params(GBInterpreter::ld_r16_a_addr, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::LdR16AddrA, opcode >> 4 & 0b11);
 
     } else if ((opcode & 0xC0) == 0 && (opcode & 0x0f) == 0b1010) {
-      emit_fallback_one_params(GBInterpreter::ld_a_r16_addr, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::LdAR16Addr, opcode >> 4 & 0b11);
 
     } else if ((opcode & 0xC0) == 0 && (opcode & 0x0f) == 0b0011) {
-      // PANIC("38!\n");
-      emit_fallback_one_params(GBInterpreter::inc_r16, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::IncR16, opcode >> 4 & 0b11);
 
     } else if ((opcode & 0xC0) == 0 && (opcode & 0x0f) == 0b1011) {
-      // PANIC("37!\n");
-      emit_fallback_one_params(GBInterpreter::dec_r16, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::DecR16, opcode >> 4 & 0b11);
 
     } else if (opcode >> 6 == 0b00 && (opcode & 0x7) == 0b100) {
-      emit_fallback_one_params(GBInterpreter::inc_r8, core, opcode >> 3 & 0x7);
+      native(IROp::IncR8, opcode >> 3 & 0x7);
 
     } else if (opcode >> 6 == 0b00 && (opcode & 0x7) == 0b101) {
-      emit_fallback_one_params(GBInterpreter::dec_r8, core, opcode >> 3 & 0x7);
+      native(IROp::DecR8, opcode >> 3 & 0x7);
 
     } else if (opcode == 0b0111'0110) {
-      // PANIC("how to handle halt?");
-      emit_fallback_no_params(GBInterpreter::halt, core);
+      fallback(GBInterpreter::halt);
       jump_emitted = true; // immediately exit, in order to turn cpu core off
 
     } else if (opcode >> 6 == 0b00 && (opcode & 0x7) == 0b110) {
-      emit_fallback_one_params(GBInterpreter::ld_r8_u8, core,
-                               opcode >> 3 & 0x7);
-      dyn_pc++;
+      native(IROp::LdR8Imm, opcode >> 3 & 0x7, 0,
+             fetch_u8(core, dyn_pc++));
 
     } else if (opcode == 0b0010'0111) {
-      // PANIC("36!\n");
-      emit_fallback_no_params(GBInterpreter::daa, core);
+      fallback(GBInterpreter::daa);
 
     } else if (opcode == 0b0001'1111) {
-      // PANIC("35!\n");
-      emit_fallback_no_params(GBInterpreter::rra, core);
+      fallback(GBInterpreter::rra);
 
     } else if (opcode == 0b0010'1111) {
-      // PANIC("34!\n");
-      emit_fallback_no_params(GBInterpreter::cpl, core);
+      fallback(GBInterpreter::cpl);
 
     } else if (opcode == 0b0011'0111) {
-      // PANIC("33!\n");
-      emit_fallback_no_params(GBInterpreter::scf, core);
+      fallback(GBInterpreter::scf);
 
     } else if (opcode == 0b0011'1111) {
-      // PANIC("32!\n");
-      emit_fallback_no_params(GBInterpreter::ccf, core);
+      fallback(GBInterpreter::ccf);
 
     } else if (opcode == 0b0000'0111) {
-      // PANIC("31!\n");
-      emit_fallback_no_params(GBInterpreter::rlca, core);
+      fallback(GBInterpreter::rlca);
 
     } else if (opcode == 0b0001'0111) {
-      // PANIC("30!\n");
-      emit_fallback_no_params(GBInterpreter::rla_acc, core);
+      fallback(GBInterpreter::rla_acc);
 
     } else if (opcode == 0b0000'1111) {
-      // PANIC("29!\n");
-      emit_fallback_no_params(GBInterpreter::rrca, core);
+      fallback(GBInterpreter::rrca);
 
     } else if (opcode >> 6 == 0b01) {
-      emit_fallback_two_params(GBInterpreter::ld_r8_r8, core, opcode >> 3 & 0x7,
-                               opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10110) {
-      // FIXME: get_r8 will not work because we are in compile time land!!
-      emit_fallback_one_params(GBInterpreter::or_a_r8, core, opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10101) {
-      // PANIC("hit 1\n");
-      emit_fallback_one_params(GBInterpreter::xor_a_r8, core, opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10111) {
-      // PANIC("hit 2\n");
-      emit_fallback_one_params(GBInterpreter::cp_a_value, core, opcode & 0x7);
+      native(IROp::LdR8R8, opcode >> 3 & 0x7, opcode & 0x7);
 
-    } else if (opcode >> 3 == 0b10000) {
-      //  PANIC("hit 3\n");
-      emit_fallback_one_params(GBInterpreter::add_a_value, core, opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10001) {
-      // PANIC("hit 4\n");
-      emit_fallback_one_params(GBInterpreter::addc_a_value, core, opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10010) {
-      // PANIC("hit 5\n");
-      emit_fallback_one_params(GBInterpreter::sub_a_value, core, opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10011) {
-      // PANIC("hit 6\n");
-      emit_fallback_one_params(GBInterpreter::subc_a_value, core, opcode & 0x7);
-
-    } else if (opcode >> 3 == 0b10100) {
-      // PANIC("hit 7\n");
-      emit_fallback_one_params(GBInterpreter::and_a_value, core, opcode & 0x7);
+    } else if (opcode >> 6 == 0b10) {
+      // ADD/ADC/SUB/SBC/AND/XOR/OR/CP A, r8
+      native(IROp::AluR8, opcode >> 3 & 0x7, opcode & 0x7);
 
     } else if (opcode >> 5 == 0b110 && (opcode & 0x7) == 0) {
-      // PANIC("28!\n");
-      emit_fallback_one_params(GBInterpreter::ret_conditional, core,
-                               opcode >> 3 & 0b11);
-      jump_emitted = true;
+      // RET cc
+      conditional_exit((opcode >> 3 & 0b11) ^ 1, dyn_pc, 0);
+      ret(false);
+      taken_cycles = 12;
 
     } else if (opcode == 0b1110'0000) {
-      // PANIC("27!\n");
-      emit_fallback_no_params(GBInterpreter::ldh_u8_a, core);
-      dyn_pc++;
+      native(IROp::LdAddrA, 0, 0, 0xFF00 + fetch_u8(core, dyn_pc++));
 
     } else if (opcode == 0b1110'1000) {
-      // PANIC("26!\n");
-      emit_fallback_no_params(GBInterpreter::add_sp_i8, core);
+      fallback(GBInterpreter::add_sp_i8);
       dyn_pc++;
 
     } else if (opcode == 0b1111'0000) {
-      // PANIC("25!\n");
-      emit_fallback_no_params(GBInterpreter::ldh_a_u8, core);
-      dyn_pc++;
+      native(IROp::LdAAddr, 0, 0, 0xFF00 + fetch_u8(core, dyn_pc++));
 
     } else if (opcode == 0b1111'1000) {
-      // PANIC("24!\n");
-      emit_fallback_no_params(GBInterpreter::ld_hl_sp_i8, core);
+      fallback(GBInterpreter::ld_hl_sp_i8);
       dyn_pc++;
 
     } else if (opcode >> 6 == 0b11 && (opcode & 0xf) == 0b0001) {
-      // PANIC("23!\n");
-      emit_fallback_one_params(GBInterpreter::pop_r16, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::Pop, opcode >> 4 & 0b11);
 
     } else if (opcode == 0b1111'1001) {
-      // PANIC("22!\n");
-      emit_fallback_no_params(GBInterpreter::ld_sp_hl, core);
+      fallback(GBInterpreter::ld_sp_hl);
 
     } else if (opcode == 0b1110'1001) {
-      // PANIC("21!\n");
-      emit_fallback_no_params(GBInterpreter::jp_hl, core);
+      fallback(GBInterpreter::jp_hl);
       jump_emitted = true;
+      indirect = IndirectExit::Jump;
 
     } else if (opcode == 0b1100'1001) {
-      // PANIC("20!\n");
-      emit_fallback_no_params(GBInterpreter::ret, core);
-      jump_emitted = true;
+      ret(false);
 
     } else if (opcode == 0b1101'1001) {
-      // PANIC("19!\n");
-      // PANIC("interrupts? reti");
-      emit_fallback_no_params(GBInterpreter::reti, core);
-      jump_emitted = true;
+      ret(true);
 
     } else if (opcode >> 5 == 0b110 && (opcode & 0x7) == 0b010) {
-      // PANIC("18!\n");
-      emit_fallback_one_params(GBInterpreter::jp_conditional, core,
-                               opcode >> 3 & 0b11);
-      jump_emitted = true;
+      dyn_pc += 2;
+      conditional_branch(opcode >> 3 & 0b11, initial_dyn_pc,
+                         fetch_u16(core, dyn_pc - 2), 4);
 
     } else if (opcode == 0b1110'0010) {
-      // PANIC("17!\n");
-      emit_fallback_no_params(GBInterpreter::ld_c_a, core);
+      native(IROp::LdCA);
 
     } else if (opcode == 0b1111'1010) {
-      // PANIC("16!\n");
-      emit_fallback_no_params(GBInterpreter::ld_a_u16, core);
+      native(IROp::LdAAddr, 0, 0, fetch_u16(core, dyn_pc));
       dyn_pc += 2;
 
     } else if (opcode == 0b1111'0010) {
-      // PANIC("15!\n");
-      emit_fallback_no_params(GBInterpreter::ld_a_c, core);
+      native(IROp::LdAC);
 
     } else if (opcode == 0b1100'0011) {
-      emit_fallback_no_params(GBInterpreter::jp_u16, core);
-      jump_emitted = true;
+      dyn_pc += 2;
+      static_jump_to(fetch_u16(core, dyn_pc - 2));
 
     } else if (opcode == 0b1111'0011) {
-      // PANIC("14!\n");
-      // PANIC("interrupts? di\n");
-      emit_fallback_no_params(GBInterpreter::di, core);
+      fallback(GBInterpreter::di);
 
     } else if (opcode == 0b1111'1011) {
       // INTERRUPTS
-      // PANIC("interrupts? ei\n");
-      emit_fallback_no_params(GBInterpreter::ei, core);
+      fallback(GBInterpreter::ei);
+      ei_emitted = true;
+      jump_emitted = true;
 
     } else if (opcode >> 5 == 0b110 && (opcode & 0x7) == 0b0100) {
-      // PANIC("13!\n");
-      emit_fallback_one_params(GBInterpreter::call_conditional, core,
-                               opcode >> 3 & 0b11);
-      jump_emitted = true;
+      // CALL cc, the rest of which is CALL u16
+      conditional_exit((opcode >> 3 & 0b11) ^ 1, dyn_pc + 2, 0);
+      dyn_pc += 2;
+      taken_cycles = 12;
+      call(dyn_pc, fetch_u16(core, dyn_pc - 2));
 
     } else if (opcode == 0xCB) {
-      // PANIC("12!\n");
-      const auto second = core.mem_read<uint8_t>(dyn_pc++);
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
+      const auto second = fetch_u8(core, dyn_pc++);
       static_cycles_taken += extended_instr_timing[second] * 4;
-      if (second >> 3 == 0b00111) {
-        emit_fallback_one_params(GBInterpreter::srl, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00011) {
-        emit_fallback_one_params(GBInterpreter::rr, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00110) {
-        emit_fallback_one_params(GBInterpreter::swap, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00000) {
-        emit_fallback_one_params(GBInterpreter::rlc, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00001) {
-        emit_fallback_one_params(GBInterpreter::rrc, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00010) {
-        emit_fallback_one_params(GBInterpreter::rl, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00100) {
-        emit_fallback_one_params(GBInterpreter::sla, core, second & 0x7);
-
-      } else if (second >> 3 == 0b00101) {
-        emit_fallback_one_params(GBInterpreter::sra, core, second & 0x7);
+      if (second >> 6 == 0b00) {
+        // RLC/RRC/RL/RR/SLA/SRA/SWAP/SRL r8
+        native(IROp::Shift, second & 0x7, second >> 3);
 
       } else if (second >> 6 == 0b01) {
-        emit_fallback_two_params(GBInterpreter::bit, core, second & 0x7,
-                                 second >> 3 & 0x7);
+        native(IROp::Bit, second & 0x7, second >> 3 & 0x7);
 
       } else if (second >> 6 == 0b10) {
-        emit_fallback_two_params(GBInterpreter::res, core, second & 0x7,
-                                 second >> 3 & 0x7);
+        native(IROp::Res, second & 0x7, second >> 3 & 0x7);
 
       } else if (second >> 6 == 0b11) {
-        emit_fallback_two_params(GBInterpreter::set, core, second & 0x7,
-                                 second >> 3 & 0x7);
+        native(IROp::Set, second & 0x7, second >> 3 & 0x7);
 
       } else {
         PANIC("Unhandled bit opcode: 0x{:02X} | 0b{:08b}\n", second, second);
       }
 
     } else if (opcode >> 6 == 0b11 && (opcode & 0xf) == 0b0101) {
-      // PANIC("11!\n");
-      emit_fallback_one_params(GBInterpreter::push_r16, core,
-                               opcode >> 4 & 0b11);
+      native(IROp::Push, opcode >> 4 & 0b11);
 
     } else if (opcode == 0b1100'1101) {
-      // PANIC("10!\n");
-      emit_fallback_no_params(GBInterpreter::call_u16, core);
       dyn_pc += 2;
-      jump_emitted = true;
+      call(dyn_pc, fetch_u16(core, dyn_pc - 2));
 
-    } else if (opcode == 0b1111'1110) {
-      // PANIC("9!\n");
-      emit_fallback_one_params(GBInterpreter::cp_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1110'0110) {
-      // PANIC("8!\n");
-      emit_fallback_one_params(GBInterpreter::and_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1100'0110) {
-      // PANIC("7!\n");
-      emit_fallback_one_params(GBInterpreter::add_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1101'0110) {
-      // PANIC("6!\n");
-      emit_fallback_one_params(GBInterpreter::sub_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1110'1110) {
-      // PANIC("5!\n");
-      emit_fallback_one_params(GBInterpreter::xor_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1100'1110) {
-      // PANIC("4!\n");
-      emit_fallback_one_params(GBInterpreter::addc_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1111'0110) {
-      // PANIC("3!\n");
-      emit_fallback_one_params(GBInterpreter::or_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
-
-    } else if (opcode == 0b1101'1110) {
-      // PANIC("2!\n");
-      emit_fallback_one_params(GBInterpreter::subc_value, core,
-                               core.mem_read<uint8_t>(dyn_pc++));
-      code.add(word[SAVED2 + get_offset(core, &core.pc)], 1);
+    } else if (opcode >> 6 == 0b11 && (opcode & 0x7) == 0b110) {
+      // ADD/ADC/SUB/SBC/AND/XOR/OR/CP A, u8
+      native(IROp::AluImm, opcode >> 3 & 0x7, 0,
+             fetch_u8(core, dyn_pc++));
 
     } else if (opcode >> 6 == 0b11 && (opcode & 0x7) == 0b111) {
-      // PANIC("1!\n");
-      emit_fallback_one_params(GBInterpreter::rst, core, opcode >> 3 & 0x7);
-      jump_emitted = true;
+      call(dyn_pc, opcode & 0x38);
 
     } else {
       PANIC("Unhandled opcode: 0x{:02X} | 0b{:08b}\n", opcode, opcode);
     }
 
-    code.add(SAVED1, rax);
+    for (auto i = first_inst; i < ir.size(); i++) {
+      ir[i].cycles = static_cycles_taken;
+      if (ir[i].next_pc == PC_PENDING) {
+        const bool jumped = jump_emitted && (ir[i].op == IROp::Fallback ||
+                                             ir[i].op == IROp::Ret);
+        ir[i].next_pc = jumped ? PC_DYNAMIC : dyn_pc;
+      }
+    }
+    // everything from here on only runs if the branch was taken
+    static_cycles_taken += std::exchange(taken_cycles, 0);
 
     // reasons to exit a block:
-    // -> the page boundary has been reached or crossed
-    // -> any instruction that may modify the pc has been emitted
-    bool old_page = initial_dyn_pc >> PAGE_SHIFT;
-    bool new_page = dyn_pc >> PAGE_SHIFT;
-    if (old_page != new_page || jump_emitted ||
-        (dyn_pc & (PAGE_SIZE - 1)) == 0) {
+    // -> any instruction that may modify the pc, or EI, has been emitted
+    // -> the page boundary has been reached or crossed, for blocks in RAM.
+    //    Those may overwrite their own code, so they are kept short
+    // -> the next instruction lies in another 16KB region, which for cartridge
+    //    ROM may be banked independently of this one
+    // -> the block has reached MAX_BLOCK_INSTRUCTIONS
+    const auto old_page = initial_dyn_pc >> PAGE_SHIFT;
+    const auto new_page = dyn_pc >> PAGE_SHIFT;
+    const bool new_region =
+        (initial_dyn_pc ^ dyn_pc) >> 14 || (dyn_pc & 0x3FFF) == 0;
+    if (jump_emitted || branch_emitted || new_region ||
+        ++instructions == MAX_BLOCK_INSTRUCTIONS) {
       break;
     }
+    if (followed || old_page != new_page || (dyn_pc & (PAGE_SIZE - 1)) == 0) {
+      if (!in_rom) {
+        break;
+      }
+      // check where a block per page would have checked before linking, so
+      // interrupts and PPU events are serviced just as precisely
+      IRInst inst{IROp::CycleCheck};
+      inst.next_pc = dyn_pc;
+      inst.cycles = static_cycles_taken;
+      ir.push_back(inst);
+    }
   }
 
-  code.mov(rax, SAVED1);
-  code.add(rax, static_cycles_taken);
-  emit_epilogue(core);
+  IRInst exit{IROp::Exit, (!jump_emitted || static_jump) && !ei_emitted};
+  exit.next_pc = static_jump ? jump_target
+                 : jump_emitted ? PC_DYNAMIC
+                                : dyn_pc;
+  exit.cycles = static_cycles_taken;
+  exit.indirect = jump_emitted && !ei_emitted ? indirect : IndirectExit::None;
+  ir.push_back(exit);
+
+  optimize_ir(core, block);
+  if (!code.getSize()) {
+    emit_dispatcher(core);
+  }
+  const auto fp = (block_fp)code.getCurr();
+  emit_ir(core, block);
+
+  // dyn_pc may have wrapped around past 0xFFFF. Traces are only ever in
+  // cartridge ROM, which doesn't get invalidated, so their range is moot
+  block.end = block.start + (uint16_t)(dyn_pc - block.start);
+  if (trace) {
+    block.end = block.start + 1;
+  }
+  const size_t host_bytes = code.getCurr<uint8_t*>() - (uint8_t*)fp;
+  if (perf_map.is_open()) {
+    write_perf_map(fp, host_bytes, block.start, bank, trace);
+  }
+  if (stats) {
+    const auto compile_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - compile_start);
+    std::lock_guard lock(stats_mutex);
+    auto& entry = block_stats[stats_key(in_rom, block.start, bank)];
+    entry.host_bytes = host_bytes;
+    entry.fallbacks = std::count_if(ir.begin(), ir.end(), [](const auto& inst) {
+      return inst.op == IROp::Fallback && !inst.dead;
+    });
+    entry.compiles++;
+    entry.compile_ns += compile_ns.count();
+  }
+  publish_fp(block, fp);
+}
 
-  return emitted_function;
+// One line per block: start, size, and name, after where it was compiled from
+// (gb_rom<bank>_<address>, gb_ram_<address>), with _trace for traces. Emitted
+// code gets reused once the code cache is flushed, so later lines for the
+// same range take over from earlier ones
+void GBCachedInterpreter::write_perf_map(block_fp fp, size_t size,
+                                         uint16_t start, uint32_t bank,
+                                         bool trace) {
+  const auto name = compile_in_rom
+                        ? fmt::format("gb_rom{:02x}_{:04x}",
+                                      start >= 0x4000 ? bank : 0, start)
+                        : fmt::format("gb_ram_{:04x}", start);
+  perf_map << fmt::format("{:x} {:x} {}{}\n", (uintptr_t)fp, size, name,
+                          trace ? "_trace" : "");
+  perf_map.flush();
 }
 
-void GBCachedInterpreter::invalidate_page(uint16_t addr) {
-  auto& page = block_page_table[addr >> PAGE_SHIFT];
-  if (page) {
+// Guest register sets for optimize_ir, with a bit per r8 (in r8 order) and
+// SP_SLOT for SP
+constexpr uint16_t ALL_REGS = 0x1FF;
+constexpr uint16_t HL_REGS = 3 << 4;
+
+static uint16_t r16_regs(int gp1) {
+  return gp1 == 3 ? 1 << SP_SLOT : 3 << gp1 * 2;
+}
+
+static uint16_t r8_regs(int r8) { return r8 == 6 ? HL_REGS : 1 << r8; }
+
+// Guest registers an instruction reads and writes
+static void ir_regs(const IRInst& inst, uint16_t& uses, uint16_t& defs) {
+  constexpr uint16_t A = 1 << 7;
+  constexpr uint16_t C = 1 << 1;
+  uses = 0;
+  defs = 0;
+  switch (inst.op) {
+    case IROp::Fallback:
+    case IROp::BulkLoop:
+    case IROp::ConditionalExit:
+    case IROp::CycleCheck:
+    case IROp::Exit:
+      uses = ALL_REGS;
+      break;
+    case IROp::LdR8R8:
+      uses = r8_regs(inst.b) | (inst.a == 6 ? HL_REGS : 0);
+      defs = inst.a == 6 ? 0 : 1 << inst.a;
+      break;
+    case IROp::LdR8Imm:
+      uses = inst.a == 6 ? HL_REGS : 0;
+      defs = inst.a == 6 ? 0 : 1 << inst.a;
+      break;
+    case IROp::LdR16Imm:
+      defs = r16_regs(inst.a);
+      break;
+    case IROp::LdAR16Addr:
+    case IROp::LdR16AddrA:
+      uses = r16_regs(std::min(inst.a, 2));
+      if (inst.op == IROp::LdAR16Addr) {
+        defs = A;
+      } else {
+        uses |= A;
+      }
+      if (inst.a >= 2) {
+        defs |= HL_REGS;
+      }
+      break;
+    case IROp::LdAAddr:
+      defs = A;
+      break;
+    case IROp::LdAddrA:
+      uses = A;
+      break;
+    case IROp::LdAC:
+      uses = C;
+      defs = A;
+      break;
+    case IROp::LdCA:
+      uses = C | A;
+      break;
+    case IROp::AluR8:
+    case IROp::AluImm:
+      uses = A | (inst.op == IROp::AluR8 ? r8_regs(inst.b) : 0);
+      defs = inst.a == 7 ? 0 : A;
+      break;
+    case IROp::IncR8:
+    case IROp::DecR8:
+      uses = r8_regs(inst.a);
+      defs = inst.a == 6 ? 0 : 1 << inst.a;
+      break;
+    case IROp::IncR16:
+    case IROp::DecR16:
+      uses = defs = r16_regs(inst.a);
+      break;
+    case IROp::Shift:
+    case IROp::Bit:
+    case IROp::Res:
+    case IROp::Set:
+      uses = r8_regs(inst.a);
+      defs = inst.op == IROp::Bit || inst.a == 6 ? 0 : 1 << inst.a;
+      break;
+    case IROp::Push:
+    case IROp::Pop: {
+      const uint16_t regs = inst.a == 3 ? A : r16_regs(inst.a);
+      uses = defs = 1 << SP_SLOT;
+      if (inst.op == IROp::Push) {
+        uses |= regs;
+      } else {
+        defs |= regs;
+      }
+      break;
+    }
+    case IROp::PushImm:
+    case IROp::Ret:
+      uses = defs = 1 << SP_SLOT;
+      break;
+    case IROp::PushReturn:
+      break;
+  }
+}
+
+// Guest flags an instruction reads and writes
+static void ir_flags(const IRInst& inst, uint8_t& reads, uint8_t& writes) {
+  reads = 0;
+  writes = 0;
+  switch (inst.op) {
+    case IROp::Fallback:
+    case IROp::BulkLoop:
+    case IROp::ConditionalExit:
+    case IROp::CycleCheck:
+    case IROp::Exit:
+      reads = 0xF0;
+      break;
+    case IROp::AluR8:
+    case IROp::AluImm:
+      // ADC and SBC
+      reads = inst.a == 1 || inst.a == 3 ? FLAG_C : 0;
+      writes = 0xF0;
+      break;
+    case IROp::IncR8:
+    case IROp::DecR8:
+      writes = FLAG_Z | FLAG_N | FLAG_H;
+      break;
+    case IROp::Shift:
+      // RL and RR
+      reads = inst.b == 2 || inst.b == 3 ? FLAG_C : 0;
+      writes = 0xF0;
+      break;
+    case IROp::Bit:
+      writes = FLAG_Z | FLAG_N | FLAG_H;
+      break;
+    case IROp::Push:
+      reads = inst.a == 3 ? 0xF0 : 0;
+      break;
+    case IROp::Pop:
+      writes = inst.a == 3 ? 0xF0 : 0;
+      break;
+    default:
+      break;
+  }
+}
+
+// Whether an instruction may write to the MBC registers, switching ROM banks
+static bool ir_may_switch_bank(const IRInst& inst) {
+  switch (inst.op) {
+    case IROp::Fallback:
+    case IROp::LdR16AddrA:
+    case IROp::Push:
+    case IROp::PushImm:
+      return true;
+    case IROp::LdAddrA:
+      return inst.imm < 0x8000;
+    case IROp::LdR8R8:
+    case IROp::LdR8Imm:
+    case IROp::IncR8:
+    case IROp::DecR8:
+    case IROp::Shift:
+    case IROp::Res:
+    case IROp::Set:
+      return inst.a == 6;
+    default:
+      return false;
+  }
+}
+
+// Whether an instruction does nothing but write guest registers and flags,
+// so it can go once nothing reads those anymore
+static bool ir_removable(const IRInst& inst) {
+  switch (inst.op) {
+    case IROp::LdR8R8:
+      return inst.a != 6 && inst.b != 6;
+    case IROp::LdR8Imm:
+    case IROp::IncR8:
+    case IROp::DecR8:
+    case IROp::Shift:
+    case IROp::Bit:
+    case IROp::Res:
+    case IROp::Set:
+      return inst.a != 6;
+    case IROp::AluR8:
+      return inst.b != 6;
+    case IROp::LdR16Imm:
+    case IROp::AluImm:
+    case IROp::IncR16:
+    case IROp::DecR16:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Passes over the IR of the block being compiled:
+// -> constant propagation: guest registers with values known at compile time
+//    (from LD r, u8 / LD r16, u16 and what's computed from them) become
+//    immediates, and memory accesses through them constant addresses. Loads
+//    of a value a register already holds are dropped
+// -> loads from cartridge ROM that can't be remapped under the block become
+//    immediates: 0x0000-0x3FFF unless the bootrom covers it, and in blocks
+//    compiled from a ROM bank, that bank until the block may have switched
+//    banks. Blocks in 0x4000-0x7FFF only ever run with their bank mapped, see
+//    switch_rom_bank
+// -> dead flag and register elimination: walking backwards, records which
+//    guest flags each instruction has to produce (see emit_defer_flags), and
+//    drops instructions whose registers and flags are all overwritten before
+//    anything reads them. Fallbacks and exits read everything
+void GBCachedInterpreter::optimize_ir(Core& core, const Block& block) {
+  std::array<int, 8> known;
+  known.fill(-1);
+  auto known_r16 = [&](int gp1) {
+    if (gp1 == 3 || known[gp1 * 2] < 0 || known[gp1 * 2 + 1] < 0) {
+      return -1;
+    }
+    return known[gp1 * 2] << 8 | known[gp1 * 2 + 1];
+  };
+  auto set_r16 = [&](int gp1, int value) {
+    if (gp1 != 3) {
+      known[gp1 * 2] = value < 0 ? -1 : value >> 8 & 0xFF;
+      known[gp1 * 2 + 1] = value < 0 ? -1 : value & 0xFF;
+    }
+  };
+  auto& a = known[7];
+  // swaps an instruction for an equivalent one, at the same guest pc
+  auto rewrite = [](IRInst& inst, IROp op, int a, int b, uint16_t imm) {
+    inst.op = op;
+    inst.a = a;
+    inst.b = b;
+    inst.imm = imm;
+  };
+  bool bank_fixed = compile_in_rom && block.start >= 0x4000;
+  auto rom_value = [&](uint16_t addr) {
+    if (addr < 0x4000 && in_cartridge_rom(addr, compile_bootrom)) {
+      return (int)core.mbc.rom_read(0, addr);
+    } else if (in_between(0x4000, 0x7FFF, addr) && bank_fixed) {
+      return (int)core.mbc.rom_read(compile_bank, addr);
+    }
+    return -1;
+  };
+  // LdAAddr, from ROM if possible
+  auto load_a = [&](IRInst& inst) {
+    const auto value = rom_value(inst.imm);
+    if (value < 0) {
+      a = -1;
+      return;
+    }
+    rewrite(inst, IROp::LdR8Imm, 7, 0, value);
+    inst.dead = a == value;
+    a = value;
+  };
+
+  for (auto& inst : ir) {
+    switch (inst.op) {
+      case IROp::Fallback:
+      case IROp::BulkLoop:
+        known.fill(-1);
+        break;
+
+      case IROp::LdR8R8:
+        if (inst.b == 6) {
+          known[inst.a] = -1;
+          if (inst.a == 7 && known_r16(2) >= 0) {
+            rewrite(inst, IROp::LdAAddr, 0, 0, (uint16_t)known_r16(2));
+            load_a(inst);
+          }
+          break;
+        }
+        if (inst.a == 6) {
+          if (inst.b == 7 && known_r16(2) >= 0) {
+            rewrite(inst, IROp::LdAddrA, 0, 0, (uint16_t)known_r16(2));
+          }
+          break;
+        }
+        if (known[inst.b] < 0) {
+          known[inst.a] = -1;
+          break;
+        }
+        rewrite(inst, IROp::LdR8Imm, inst.a, 0, (uint16_t)known[inst.b]);
+        [[fallthrough]];
+
+      case IROp::LdR8Imm:
+        if (inst.a != 6) {
+          inst.dead = known[inst.a] == inst.imm;
+          known[inst.a] = inst.imm;
+        }
+        break;
+
+      case IROp::LdR16Imm:
+        inst.dead = inst.a != 3 && known_r16(inst.a) == inst.imm;
+        set_r16(inst.a, inst.imm);
+        break;
+
+      case IROp::LdAR16Addr:
+      case IROp::LdR16AddrA: {
+        const auto addr = known_r16(std::min(inst.a, 2));
+        if (inst.op == IROp::LdAR16Addr) {
+          a = -1;
+        }
+        if (inst.a < 2) {
+          if (addr >= 0) {
+            const auto op = inst.op == IROp::LdAR16Addr ? IROp::LdAAddr
+                                                        : IROp::LdAddrA;
+            rewrite(inst, op, 0, 0, (uint16_t)addr);
+            if (op == IROp::LdAAddr) {
+              load_a(inst);
+            }
+          }
+        } else {
+          const auto step = inst.a == 2 ? 1 : -1;
+          set_r16(2, addr < 0 ? -1 : (addr + step) & 0xFFFF);
+        }
+        break;
+      }
+
+      case IROp::LdAAddr:
+        load_a(inst);
+        break;
+
+      case IROp::LdAC:
+      case IROp::LdCA:
+        if (known[1] >= 0) {
+          const auto op =
+              inst.op == IROp::LdAC ? IROp::LdAAddr : IROp::LdAddrA;
+          rewrite(inst, op, 0, 0, (uint16_t)(0xFF00 | known[1]));
+        }
+        if (inst.op == IROp::LdAC || inst.op == IROp::LdAAddr) {
+          a = -1;
+        }
+        break;
+
+      case IROp::AluR8:
+        if (inst.b == 6) {
+          a = inst.a == 7 ? a : -1;
+          break;
+        }
+        if (known[inst.b] < 0) {
+          // XOR A / SUB A clear A, whatever it was
+          const bool clears = inst.b == 7 && (inst.a == 2 || inst.a == 5);
+          a = clears ? 0 : inst.a == 7 ? a : -1;
+          break;
+        }
+        rewrite(inst, IROp::AluImm, inst.a, 0, (uint16_t)known[inst.b]);
+        [[fallthrough]];
+
+      case IROp::AluImm:
+        if (a < 0) {
+          break;
+        }
+        switch (inst.a) {
+          case 0:
+            a = (a + inst.imm) & 0xFF;
+            break;
+          case 2:
+            a = (a - inst.imm) & 0xFF;
+            break;
+          case 4:
+            a &= inst.imm;
+            break;
+          case 5:
+            a ^= inst.imm;
+            break;
+          case 6:
+            a |= inst.imm;
+            break;
+          case 7:
+            break;
+          default:
+            a = -1;
+            break;
+        }
+        break;
+
+      case IROp::IncR8:
+      case IROp::DecR8:
+        if (inst.a != 6 && known[inst.a] >= 0) {
+          known[inst.a] =
+              (known[inst.a] + (inst.op == IROp::IncR8 ? 1 : -1)) & 0xFF;
+        }
+        break;
+
+      case IROp::IncR16:
+      case IROp::DecR16:
+        if (known_r16(inst.a) >= 0) {
+          const auto step = inst.op == IROp::IncR16 ? 1 : -1;
+          set_r16(inst.a, (known_r16(inst.a) + step) & 0xFFFF);
+        }
+        break;
+
+      case IROp::Shift:
+        if (inst.a != 6) {
+          known[inst.a] = -1;
+        }
+        break;
+
+      case IROp::Res:
+      case IROp::Set:
+        if (inst.a != 6 && known[inst.a] >= 0) {
+          known[inst.a] = inst.op == IROp::Set ? known[inst.a] | 1 << inst.b
+                                               : known[inst.a] & ~(1 << inst.b);
+        }
+        break;
+
+      case IROp::Pop:
+        if (inst.a == 3) {
+          a = -1;
+        } else {
+          set_r16(inst.a, -1);
+        }
+        break;
+
+      default:
+        break;
+    }
+    bank_fixed = bank_fixed && !ir_may_switch_bank(inst);
+  }
+
+  uint16_t live_regs = ALL_REGS;
+  uint8_t live = 0xF0;
+  for (auto it = ir.rbegin(); it != ir.rend(); it++) {
+    auto& inst = *it;
+    if (inst.dead) {
+      continue;
+    }
+
+    uint16_t uses, defs;
+    uint8_t reads, writes;
+    ir_regs(inst, uses, defs);
+    ir_flags(inst, reads, writes);
+    if (ir_removable(inst) && !(defs & live_regs) && !(writes & live)) {
+      inst.dead = true;
+      continue;
+    }
+
+    inst.live_flags = live;
+    live = (live & ~writes) | reads;
+    live_regs = (live_regs & ~defs) | uses;
+  }
+}
+
+// Emits the optimized IR of the block being compiled
+// Whether inst may store to an I/O register that zeroes the cycle budget (see
+// Core::may_zero_budget). Stores to an address only known at run time may, as
+// may fallbacks
+static bool may_zero_budget(const IRInst& inst) {
+  switch (inst.op) {
+    case IROp::Fallback:
+    case IROp::LdR16AddrA:
+    case IROp::LdCA:
+      return true;
+    case IROp::LdAddrA:
+      return Core::may_zero_budget(inst.imm);
+    case IROp::LdR8R8:
+    case IROp::LdR8Imm:
+    case IROp::IncR8:
+    case IROp::DecR8:
+    case IROp::Shift:
+    case IROp::Res:
+    case IROp::Set:
+      return inst.a == 6;
+    default:
+      return false;
+  }
+}
+
+void GBCachedInterpreter::emit_ir(Core& core, Block& block) {
+  pending_flags = {};
+  guest_regs = {};
+  // blocks are only ever entered at their start, with core.pc pointing there
+  synced_pc = block.start;
+
+  emit_prologue(core);
+  // SAVED1 will hold all dynamically emitted cycles
+  code.mov(SAVED1, 0);
+  // SAVED2 will hold a pointer to the core
+  code.mov(SAVED2, (uintptr_t)&core);
+
+  // Linked blocks jump here, and keep accumulating cycles in SAVED1
+  block.body = code.getCurr();
+
+  // linkable exits for the return addresses of the block's calls, emitted
+  // after everything else, see emit_push_return
+  std::deque<Xbyak::Label> landings;
+  for (const auto& inst : ir) {
+    if (inst.dead) {
+      continue;
+    }
+
+    live_flags = inst.live_flags;
+    // RET reads the stack before it jumps
+    const auto pc = inst.op == IROp::Ret ? inst.operand_pc : inst.next_pc;
+    guest_state = {(uint16_t)pc};
+    switch (inst.op) {
+      case IROp::Fallback:
+        emit_sync_pc(core, inst.operand_pc);
+        if (inst.params == 0) {
+          emit_fallback_no_params(reinterpret_cast<no_params_fp>(inst.fallback),
+                                  core);
+        } else if (inst.params == 1) {
+          emit_fallback_one_params(
+              reinterpret_cast<one_params_fp>(inst.fallback), core, inst.a);
+        } else {
+          emit_fallback_two_params(
+              reinterpret_cast<two_params_fp>(inst.fallback), core, inst.a,
+              inst.b);
+        }
+        synced_pc = inst.next_pc;
+        break;
+      case IROp::LdR8R8:
+        emit_ld_r8_r8(core, inst.a, inst.b);
+        break;
+      case IROp::LdR8Imm:
+        emit_ld_r8_u8(core, inst.a, inst.imm);
+        break;
+      case IROp::LdR16Imm:
+        emit_ld_r16_u16(core, inst.a, inst.imm);
+        break;
+      case IROp::LdAR16Addr:
+        emit_ld_a_r16_addr(core, inst.a);
+        break;
+      case IROp::LdR16AddrA:
+        emit_ld_r16_addr_a(core, inst.a);
+        break;
+      case IROp::LdAAddr:
+        emit_ld_a_addr(core, inst.imm);
+        break;
+      case IROp::LdAddrA:
+        emit_ld_addr_a(core, inst.imm);
+        break;
+      case IROp::LdAC:
+        emit_ld_a_c(core);
+        break;
+      case IROp::LdCA:
+        emit_ld_c_a(core);
+        break;
+      case IROp::AluR8:
+        emit_alu_a_r8(core, inst.a, inst.b);
+        break;
+      case IROp::AluImm:
+        emit_alu_a_u8(core, inst.a, inst.imm);
+        break;
+      case IROp::IncR8:
+        emit_inc_r8(core, inst.a);
+        break;
+      case IROp::DecR8:
+        emit_dec_r8(core, inst.a);
+        break;
+      case IROp::IncR16:
+        emit_inc_r16(core, inst.a);
+        break;
+      case IROp::DecR16:
+        emit_dec_r16(core, inst.a);
+        break;
+      case IROp::Shift:
+        emit_shift_r8(core, inst.b, inst.a);
+        break;
+      case IROp::Bit:
+        emit_bit_r8(core, inst.b, inst.a);
+        break;
+      case IROp::Res:
+      case IROp::Set:
+        emit_res_set_r8(core, inst.b, inst.a, inst.op == IROp::Set);
+        break;
+      case IROp::Push:
+        emit_push_r16(core, inst.a);
+        break;
+      case IROp::Pop:
+        emit_pop_r16(core, inst.a);
+        break;
+      case IROp::PushImm:
+        emit_push_imm(core, inst.imm);
+        break;
+      case IROp::Ret:
+        emit_ret(core, inst.a);
+        synced_pc = PC_DYNAMIC;
+        break;
+      case IROp::ConditionalExit:
+        emit_conditional_exit(core, inst);
+        break;
+      case IROp::CycleCheck:
+        emit_cycle_check(core, inst.cycles, inst.next_pc);
+        break;
+      case IROp::BulkLoop:
+        emit_bulk_loop(core, inst.bulk);
+        break;
+      case IROp::PushReturn:
+        emit_push_return(core, inst.imm, landings.emplace_back());
+        break;
+      case IROp::Exit:
+        emit_flush_flags(core);
+        emit_writeback_regs(core);
+        if (inst.next_pc != PC_DYNAMIC) {
+          emit_sync_pc(core, inst.next_pc);
+        }
+        code.add(SAVED1, inst.cycles);
+        if (inst.indirect != IndirectExit::None) {
+          emit_indirect_exit(core, inst.indirect);
+        } else {
+          emit_block_exit(core, inst.a);
+        }
+        break;
+    }
+
+    // leave right away if a store zeroed the cycle budget, to service the
+    // interrupt it requested or compute the budget again
+    if (may_zero_budget(inst) && inst.next_pc >= 0) {
+      emit_cycle_check(core, inst.cycles, inst.next_pc);
+    }
+  }
+  live_flags = 0xF0;
+
+  for (auto& landing : landings) {
+    code.L(landing);
+    emit_block_exit(core, true);
+  }
+}
+
+// Marks the code pages a freshly compiled block covers, so that writes to them
+// find their way to invalidate
+void GBCachedInterpreter::register_block(Core& core, Block& block) {
+  // cartridge ROM never changes, short of a bank switch
+  if (in_cartridge_rom(core, block.start)) {
+    return;
+  }
+
+  for (uint32_t page = block.start >> PAGE_SHIFT;
+       page <= (block.end - 1) >> PAGE_SHIFT; page++) {
+    if (page_blocks[page].empty()) {
+      core.code_bitmap[page >> 3] |= 1 << (page & 7);
+      core.write_pages[page >> 3] = nullptr;
+    }
+    page_blocks[page].push_back(&block);
+  }
+}
+
+void GBCachedInterpreter::invalidate_block(Core& core, Block& block) {
+  unlink_block(block);
+  publish_fp(block, nullptr);
+  if (block_stats_enabled) {
+    std::lock_guard lock(stats_mutex);
+    block_stats[stats_key(false, block.start, 0)].invalidations++;
+  }
+
+  for (uint32_t page = block.start >> PAGE_SHIFT;
+       page <= (block.end - 1) >> PAGE_SHIFT; page++) {
+    auto& blocks = page_blocks[page];
+    blocks.erase(std::find(blocks.begin(), blocks.end(), &block));
+    if (blocks.empty()) {
+      // let emitted code write to this memory directly again, once it no
+      // longer holds any blocks
+      core.code_bitmap[page >> 3] &= ~(1 << (page & 7));
+      if (!core.code_bitmap[page >> 3]) {
+        core.map_page(page >> 3);
+      }
+    }
+  }
+}
+
+// Throws out every block with code in [start, end)
+void GBCachedInterpreter::invalidate(Core& core, uint32_t start, uint32_t end) {
+  end = std::min(end, 0x10000u);
+  for (uint32_t page = start >> PAGE_SHIFT; page <= (end - 1) >> PAGE_SHIFT;
+       page++) {
+    auto& blocks = page_blocks[page];
+    for (size_t i = 0; i < blocks.size();) {
+      auto& block = *blocks[i];
+      if (block.start < end && start < block.end) {
+        invalidate_block(core, block); // removes it from blocks
+      } else {
+        i++;
+      }
+    }
+  }
+}
+
+// Swaps the blocks compiled from the new bank into block_page_table, keeping
+// those of the old one around for when it gets mapped again
+void GBCachedInterpreter::switch_rom_bank(uint32_t bank) {
+  // links into the old bank would now run the wrong code
+  for (auto* block : banked_link_targets) {
+    unlink_block(*block);
+  }
+  banked_link_targets.clear();
+
+  if (std::max(bank, mapped_rom_bank) >= rom_bank_pages.size()) {
+    rom_bank_pages.resize(std::max(bank, mapped_rom_bank) + 1);
+  }
+
+  auto* banked = &block_page_table[0x4000 >> PAGE_SHIFT];
+  auto& old_pages = rom_bank_pages[mapped_rom_bank];
+  auto& new_pages = rom_bank_pages[bank];
+  std::copy_n(banked, old_pages.size(), old_pages.begin());
+  std::copy(new_pages.begin(), new_pages.end(), banked);
+  new_pages.fill(nullptr);
+  mapped_rom_bank = bank;
+}
+
+// Throws out every compiled block. Only ever called from decode_execute, while
+// no emitted code is running, with compile_mutex held
+void GBCachedInterpreter::flush_cache(Core& core) {
+  DPRINT("Code cache full, flushing\n");
+  code.reset();
+  dispatcher = nullptr;
+  cache_generation++;
+  {
+    std::lock_guard lock(queue_mutex);
+    compile_queue.clear();
+  }
+  cache_full = false;
+  for (auto& page : block_page_table) {
     delete[] page;
     page = nullptr;
   }
+  for (auto& pages : rom_bank_pages) {
+    for (auto& page : pages) {
+      delete[] page;
+      page = nullptr;
+    }
+  }
+  for (auto& blocks : page_blocks) {
+    blocks.clear();
+  }
+  banked_link_targets.clear();
+  branch_profiles.clear();
+  pending_link = nullptr;
+  pending_indirect = nullptr;
+  // their landings are gone
+  return_stack.fill({});
+
+  core.code_bitmap.fill(0);
+  core.map_pages();
 }
 
-int GBCachedInterpreter::decode_execute(Core& core) {
-  auto& page = block_page_table[core.pc >> PAGE_SHIFT];
+// The block starting at addr, compiled or not
+Block& GBCachedInterpreter::get_block(uint16_t addr) {
+  auto& page = block_page_table[addr >> PAGE_SHIFT];
+  if (!page) {
+    page = new Block[PAGE_SIZE]();
+  }
+
+  return page[addr & (PAGE_SIZE - 1)];
+}
+
+// The block starting at addr in cartridge ROM, with bank mapped to
+// 0x4000-0x7FFF, whether or not that's the bank currently mapped
+Block& GBCachedInterpreter::get_block(uint16_t addr, uint32_t bank) {
+  if (addr < 0x4000 || addr >= 0x8000 || bank == mapped_rom_bank) {
+    return get_block(addr);
+  }
+
+  if (bank >= rom_bank_pages.size()) {
+    rom_bank_pages.resize(bank + 1);
+  }
+  auto& page = rom_bank_pages[bank][(addr - 0x4000) >> PAGE_SHIFT];
   if (!page) {
-    page = new block_fp[PAGE_SIZE]();
+    page = new Block[PAGE_SIZE]();
+  }
+
+  return page[addr & (PAGE_SIZE - 1)];
+}
+
+constexpr uint32_t TRANSLATION_CACHE_MAGIC = 0x434A4247; // "GBJC"
+constexpr uint32_t TRANSLATION_CACHE_VERSION = 1;
+
+// Picks the translation cache file for this ROM and compiles every block it
+// lists up front. Blocks in banks that aren't mapped go straight into
+// rom_bank_pages, compiled from MBC::rom_read
+void GBCachedInterpreter::load_translation_cache(Core& core, const char* dir) {
+  translation_cache_path =
+      fmt::format("{}/{:016x}.jit", dir, core.mbc.rom_hash());
+  translated_blocks.clear();
+
+  std::ifstream file(translation_cache_path, std::ios::binary);
+  if (!file.is_open()) {
+    return;
+  }
+
+  uint32_t header[3] = {};
+  file.read((char*)header, sizeof(header));
+  if (!file || header[0] != TRANSLATION_CACHE_MAGIC ||
+      header[1] != TRANSLATION_CACHE_VERSION) {
+    DPRINT("Ignoring stale translation cache {}\n", translation_cache_path);
+    return;
+  }
+
+  std::vector<uint32_t> keys(header[2]);
+  file.read((char*)keys.data(), keys.size() * sizeof(uint32_t));
+  if (!file) {
+    DPRINT("Ignoring truncated translation cache {}\n", translation_cache_path);
+    return;
   }
+  translated_blocks.insert(keys.begin(), keys.end());
+
+  std::lock_guard lock(compile_mutex);
+  for (auto key : translated_blocks) {
+    const uint16_t addr = key & 0xFFFF;
+    // blocks in 0x0000-0x3FFF may still run on into the mapped bank
+    const uint32_t bank = addr >= 0x4000 ? key >> 16 : mapped_rom_bank;
+    if (!in_cartridge_rom(core, addr) || bank == 0 ||
+        bank >= core.mbc.rom_banks()) {
+      continue; // not a bank this ROM has
+    }
+    if (code.getSize() + CACHE_LEEWAY > cache_size) {
+      break;
+    }
+
+    auto& block = get_block(addr, bank);
+    if (!block.fp) {
+      recompile_block(core, block, addr, bank, core.bootrom_enabled);
+    }
+  }
+
+  DPRINT("Precompiled {} blocks from {}\n", translated_blocks.size(),
+         translation_cache_path);
+}
+
+void GBCachedInterpreter::save_translation_cache() {
+  if (translation_cache_path.empty()) {
+    return;
+  }
+
+  std::ofstream file(translation_cache_path, std::ios::binary);
+  if (!file.is_open()) {
+    PRINT("Unable to write translation cache {}\n", translation_cache_path);
+    return;
+  }
+
+  std::vector<uint32_t> keys(translated_blocks.begin(),
+                             translated_blocks.end());
+  const uint32_t header[3] = {TRANSLATION_CACHE_MAGIC,
+                              TRANSLATION_CACHE_VERSION, (uint32_t)keys.size()};
+  file.write((const char*)header, sizeof(header));
+  file.write((const char*)keys.data(), keys.size() * sizeof(uint32_t));
+}
+
+int GBCachedInterpreter::decode_execute(Core& core) {
+  return core.jit->run_block(core);
+}
+
+int GBCachedInterpreter::run_block(Core& core) {
+  if (cache_full) {
+    std::lock_guard lock(compile_mutex);
+    flush_cache(core);
+  }
+
+  auto* cached_page = block_page_table[core.pc >> PAGE_SHIFT];
+  auto* cached = cached_page ? &cached_page[core.pc & (PAGE_SIZE - 1)] : nullptr;
+  if (cached && load_fp(*cached) && !cached->trace &&
+      in_cartridge_rom(core, core.pc) &&
+      ++cached->dispatches >= TRACE_THRESHOLD) {
+    // hot, so throw it out and compile a trace in its place. Its fp has been
+    // published, so the compile thread is done with it
+    unlink_block(*cached);
+    publish_fp(*cached, nullptr);
+    cached->trace = true;
+    cached->queued = false;
+  }
+
+  // code in cartridge ROM is left to the compile thread, see run_cold
+  const bool tiered =
+      compile_thread.joinable() && in_cartridge_rom(core, core.pc);
+  if (!tiered && (!cached || !load_fp(*cached))) {
+    std::lock_guard lock(compile_mutex);
+    // make room before looking anything up, as this may throw out every block
+    check_emitted_cache(core);
+
+    auto& block = get_block(core.pc);
+    if (!block.fp) {
+      recompile_block(core, block, core.pc, mapped_rom_bank,
+                      core.bootrom_enabled, block.trace);
+      register_block(core, block);
+
+      if (!translation_cache_path.empty() && in_cartridge_rom(core, core.pc)) {
+        translated_blocks.insert(rom_key(core.pc));
+      }
+    }
+  }
+
+  auto& block = get_block(core.pc);
+  const auto fp = load_fp(block);
+  if (!fp) {
+    return run_cold(core, block);
+  }
+
+  interp_next_pc = PC_DYNAMIC;
+  pending_link = nullptr;
+  pending_indirect = nullptr;
+  const auto start = core.pc;
+  const auto bank = mapped_rom_bank;
+  auto cycles_taken = fp();
+
+  if (block_stats_enabled) {
+    std::lock_guard lock(stats_mutex);
+    auto& entry =
+        block_stats[stats_key(in_cartridge_rom(core, start), start, bank)];
+    entry.executions++;
+    entry.cycles += cycles_taken;
+  }
+
+  // Link the exit we just took (or point its inline cache) to the block it led
+  // to, if that one has already been compiled. Compiling it here could throw
+  // out the code cache under us. Blocks aren't linked while collecting stats,
+  // so every block they run goes through here
+  if ((pending_link || pending_indirect) && !block_stats_enabled) {
+    auto* next_page = block_page_table[core.pc >> PAGE_SHIFT];
+    if (next_page) {
+      auto& next = next_page[core.pc & (PAGE_SIZE - 1)];
+      if (load_fp(next)) {
+        if (pending_link) {
+          link_block(pending_link, next);
+        } else {
+          link_indirect(pending_indirect, next);
+        }
+      }
+    }
+  }
+
+  return cycles_taken;
+}
 
-  auto& block = page[core.pc & (PAGE_SIZE - 1)];
-  if (!block) {
-    block = recompile_block(core);
+// Runs a block in cartridge ROM that hasn't been compiled yet through the
+// interpreter, one instruction at a time. Once it has been reached
+// TIER_UP_THRESHOLD times (or is due to become a trace), it's queued for the
+// compile thread
+int GBCachedInterpreter::run_cold(Core& core, Block& block) {
+  const auto pc = core.pc;
+  // only count where blocks start: at the target of a jump, an interrupt, or
+  // the end of another block
+  const bool block_start = pc != interp_next_pc;
+  if (block_start && !block.queued &&
+      (block.trace || ++block.dispatches >= TIER_UP_THRESHOLD)) {
+    block.queued = true;
+    if (!translation_cache_path.empty()) {
+      translated_blocks.insert(rom_key(pc));
+    }
+
+    {
+      std::lock_guard lock(queue_mutex);
+      compile_queue.push_back({&core, &block, pc, mapped_rom_bank,
+                               core.bootrom_enabled, block.trace,
+                               cache_generation});
+    }
+    queue_cv.notify_one();
   }
 
-  auto cycles_taken = (*block)();
+  const auto cycles_taken = GBInterpreter::decode_execute(core);
+  const uint16_t step = core.pc - pc;
+  interp_next_pc = step >= 1 && step <= 3 ? core.pc : PC_DYNAMIC;
   return cycles_taken;
 }
+
+// Body of compile_thread. Compiles queued blocks and publishes them, unless
+// the code cache has been flushed since they were queued
+void GBCachedInterpreter::compile_worker() {
+  while (true) {
+    CompileRequest request;
+    {
+      std::unique_lock lock(queue_mutex);
+      queue_cv.wait(lock,
+                    [&] { return stop_compiling || !compile_queue.empty(); });
+      if (stop_compiling) {
+        return;
+      }
+      request = compile_queue.front();
+      compile_queue.pop_front();
+    }
+
+    std::lock_guard lock(compile_mutex);
+    // blocks promoted to a trace since are queued again by run_cold
+    if (request.generation != cache_generation ||
+        request.trace != request.block->trace) {
+      continue;
+    }
+    // flushing is up to the dispatcher, as emitted code may be running
+    if (code.getSize() + CACHE_LEEWAY > cache_size) {
+      cache_full = true;
+      continue;
+    }
+
+    recompile_block(*request.core, *request.block, request.start, request.bank,
+                    request.bootrom_enabled, request.trace);
+  }
+}
+
+// Starts or stops collecting BlockStats. Execution counts need every block to
+// return to run_block, so enabling unlinks everything. Blocks run as linked
+// as usual again once stats are disabled, and nothing is counted. Call from the
+// thread running the core, between frames
+void GBCachedInterpreter::set_block_stats(bool enabled) {
+  if (enabled && !block_stats_enabled) {
+    auto unlink_page = [&](Block* page) {
+      for (int i = 0; page && i < PAGE_SIZE; i++) {
+        unlink_block(page[i]);
+      }
+    };
+    for (auto* page : block_page_table) {
+      unlink_page(page);
+    }
+    for (auto& pages : rom_bank_pages) {
+      for (auto* page : pages) {
+        unlink_page(page);
+      }
+    }
+    banked_link_targets.clear();
+  }
+  block_stats_enabled = enabled;
+}
+
+// Copy of the stats collected so far, by stats_key
+std::vector<std::pair<uint32_t, BlockStats>>
+GBCachedInterpreter::get_block_stats() {
+  std::lock_guard lock(stats_mutex);
+  return {block_stats.begin(), block_stats.end()};
+}
+
+// The top_n blocks by guest cycles spent in them, one line each
+std::string GBCachedInterpreter::block_stats_report(size_t top_n) {
+  auto stats = get_block_stats();
+  std::sort(stats.begin(), stats.end(), [](const auto& a, const auto& b) {
+    return a.second.cycles > b.second.cycles;
+  });
+
+  uint64_t total_cycles = 0;
+  for (const auto& [key, entry] : stats) {
+    total_cycles += entry.cycles;
+  }
+
+  auto report = fmt::format(
+      "{:<12} {:>10} {:>12} {:>6} {:>6} {:>9} {:>8} {:>6} {:>10}\n", "block",
+      "execs", "cycles", "cyc%", "bytes", "fallbacks", "compiles", "inval",
+      "compile_us");
+  for (size_t i = 0; i < std::min(top_n, stats.size()); i++) {
+    const auto& [key, entry] = stats[i];
+    const auto name =
+        key >> 16 == 0xFFFF
+            ? fmt::format("ram:{:04x}", key & 0xFFFF)
+            : fmt::format("rom{:02x}:{:04x}", key >> 16, key & 0xFFFF);
+    report += fmt::format(
+        "{:<12} {:>10} {:>12} {:>6.2f} {:>6} {:>9} {:>8} {:>6} {:>10}\n", name,
+        entry.executions, entry.cycles,
+        total_cycles ? entry.cycles * 100.0 / total_cycles : 0.0,
+        entry.host_bytes, entry.fallbacks, entry.compiles, entry.invalidations,
+        entry.compile_ns / 1000);
+  }
+  return report;
+}
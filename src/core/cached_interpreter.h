@@ -1,6 +1,17 @@
 #pragma once
 #include "common_recompiler.h"
 #include "core.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // a cached interpreter/dynamic recompiler's general flow works like this:
 //
@@ -14,11 +25,86 @@
 //
 // -> Conditions to stop block compilation:
 //    -> any sort of jump condition that may change the PC
-//    -> block exceeds page boundary
+//    -> block in RAM exceeds page boundary. Blocks in cartridge ROM run on
+//       across pages, and check the cycle budget at each page boundary instead
+//       (see emit_cycle_check)
 //
 // -> Conditions to invalidate blocks:
-//    -> write occurs to page
-//    -> MBC actions (ie, rom bank number changed)
+//    -> write occurs to code a block was compiled from. Core::code_bitmap
+//       tracks which pages have code in them, so other writes skip this
+//    -> blocks in 0x4000-0x7FFF are never invalidated by a ROM bank change.
+//       Each bank keeps its own set of them, and switching banks swaps that
+//       set into block_page_table (see switch_rom_bank)
+//
+// -> Block linking:
+//    -> blocks that end in a statically known jump (JP u16, JR, CALL u16, RST)
+//       or fall through into the next page end in a patchable jmp. Blocks that
+//       end in a conditional branch get one for either direction. The first
+//       time such an exit is taken, decode_execute patches it to jump straight
+//       into the body of the successor block, skipping the dispatcher
+//    -> before taking a link, the cycles accumulated so far are checked
+//       against Core::cycle_budget, so we still return in time for the PPU,
+//       timers and interrupts to be serviced. So is IE & IF, in case the
+//       block enabled interrupts with one pending (see emit_link_guard).
+//       Stores that move the next event or request an interrupt zero the
+//       budget (see Core::may_zero_budget), and the block leaves right after
+//    -> invalidating a block points every link into it back at its exit stub
+//    -> exits to a pc only known at run time (RET, RETI, RET cc, JP HL) end in
+//       an inline cache instead: the block that pc led to last time is linked
+//       like a static successor, guarded by comparing core.pc against it (see
+//       emit_indirect_exit)
+//    -> exits that don't take a link go on to the dispatcher at the start of
+//       the code cache (see emit_dispatcher). It looks up the block at core.pc
+//       in block_page_table and jumps into its body, and only returns to
+//       run_block to compile, link or promote blocks, once the cycle budget is
+//       used up, or when an interrupt or EI needs run_frame
+//    -> emitted CALL and RST also push their return address onto a shadow
+//       return-address stack, along with a linkable exit for it in the
+//       caller's code. RET jumps to that exit if its target matches the top
+//       entry (see emit_push_return)
+//
+// -> Traces:
+//    -> conditional branches in cartridge ROM count how often they are taken
+//    -> once a block in cartridge ROM has been dispatched TRACE_THRESHOLD
+//       times, it is recompiled as a trace. Traces follow static jumps, calls
+//       and the more frequently taken direction of conditional branches,
+//       within the 16KB region they start in, until they get back to an
+//       address they already cover. Leaving the trace's path takes a linkable
+//       side exit
+//
+// -> IR:
+//    -> recompile_block first decodes guest code into a linear list of IRInst.
+//       optimize_ir then propagates constants through it and drops flag and
+//       register updates nothing reads, and emit_ir turns what's left into
+//       host code. core.pc is only stored where something may read it: before
+//       fallbacks and on block and side exits
+//
+// -> Tiered execution (see Config::background_compile):
+//    -> code in cartridge ROM is interpreted until a block has been reached
+//       TIER_UP_THRESHOLD times, then queued for the compile thread. The
+//       dispatcher keeps interpreting it until Block::fp is published
+//    -> compiling takes compile_mutex, as does anything else touching the
+//       compiler state or the code cache. The compile thread only writes the
+//       block it compiles, and publishes it last: Block::fp is stored with
+//       release and loaded with acquire order. Block tables and the links
+//       between blocks belong to the core thread, so linking, promoting and
+//       switching ROM banks never wait for a compile to finish. Flushing the
+//       code cache bumps cache_generation, so requests queued before it are
+//       dropped instead of compiling into freed blocks
+//    -> code in RAM is still compiled right away, as it may change at any time
+//
+// -> Idle loops:
+//    -> blocks that do nothing but poll memory until it changes (see
+//       is_idle_loop) skip straight to the iteration where Core::cycle_budget
+//       runs out, as nothing they read can change before then. That needs
+//       the budget to be current, which is why stores that move the next
+//       event zero it rather than leave it to the end of the chain
+//
+// -> Copy and fill loops:
+//    -> blocks that copy or fill memory a byte per iteration (see
+//       is_bulk_loop) first run as many iterations as they can in one go, for
+//       as long as memory is plain RAM or ROM and the cycle budget allows. The
+//       block itself then runs the rest, one iteration at a time
 //
 //
 // -> Interrupts (do they need to be serviced as soon as requested?)
@@ -27,35 +113,411 @@ using no_params_fp = int (*)(Core&);
 using one_params_fp = int (*)(Core&, uint8_t);
 using two_params_fp = int (*)(Core&, uint8_t, uint8_t);
 
+struct Block {
+  // entry point from the dispatcher. May be published by the compile thread,
+  // see load_fp
+  block_fp fp = nullptr;
+  // guest code the block was compiled from, [start, end)
+  uint16_t start = 0;
+  uint32_t end = 0;
+  // entry point for linked blocks, past the prologue
+  const uint8_t* body = nullptr;
+  // link sites in other blocks that currently jump into this one. Inline caches
+  // of indirect exits may have moved on to another block since
+  std::vector<uint8_t*> links;
+  // times decode_execute ran this block, until it becomes a trace
+  uint32_t dispatches = 0;
+  bool trace = false;
+  // waiting for the compile thread
+  bool queued = false;
+};
+
+// Collected for each guest block while block stats are enabled, see
+// GBCachedInterpreter::set_block_stats. Kept across code cache flushes
+struct BlockStats {
+  uint64_t executions = 0;
+  // guest cycles those executions took
+  uint64_t cycles = 0;
+  // host code and interpreter fallbacks emitted by the last compile
+  size_t host_bytes = 0;
+  size_t fallbacks = 0;
+  uint32_t compiles = 0;
+  uint64_t compile_ns = 0;
+  uint32_t invalidations = 0;
+};
+
+// Block for the compile thread to compile, see run_cold
+struct CompileRequest {
+  Core* core;
+  Block* block;
+  uint16_t start;
+  // state of the core the block is compiled for, when queued
+  uint32_t bank;
+  bool bootrom_enabled;
+  bool trace;
+  // GBCachedInterpreter::cache_generation when queued
+  uint32_t generation;
+};
+
+// How often a conditional branch in cartridge ROM went either way. Counted by
+// emitted code, see emit_conditional_exit
+struct BranchProfile {
+  uint32_t taken = 0;
+  uint32_t not_taken = 0;
+};
+
+// Loop that copies or fills memory a byte per iteration, as recognized by
+// is_bulk_loop, e.g. LD A, (HL+) / LD (DE), A / INC DE / DEC BC / LD A, B /
+// OR C / JR NZ. Passed to run_bulk_loop packed into a uint64_t
+struct BulkLoop {
+  // gp1 pointer registers (BC, DE, HL) read from and written to, and how much
+  // each iteration steps them. Fills store A, and have no src
+  int8_t src = -1;
+  int8_t src_step = 0;
+  int8_t dst = 0;
+  int8_t dst_step = 0;
+  // r8 decremented by each iteration, or -1 for BC
+  int8_t counter = 0;
+  // spelled out, so that no byte of the packed loop is left indeterminate
+  uint8_t pad = 0;
+  // static cycles of an iteration that goes around again
+  uint16_t cycles = 0;
+};
+static_assert(sizeof(BulkLoop) == sizeof(uint64_t));
+
+// Guest flags written by the last flag producing operations of the block being
+// compiled, that haven't been stored to F yet (see emit_defer_flags)
+struct PendingFlags {
+  // taken from the host flags saved in cl
+  uint8_t from_host = 0;
+  uint8_t set = 0;
+  uint8_t clear = 0;
+};
+
+// Operations of the IR blocks are decoded into, before code is emitted for them
+enum class IROp {
+  // call into the interpreter, see emit_fallback_no_params
+  Fallback,
+  LdR8R8,
+  LdR8Imm,
+  LdR16Imm,
+  LdAR16Addr,
+  LdR16AddrA,
+  // LD A, (u16) / LD (u16), A, also for any other address known at compile time
+  LdAAddr,
+  LdAddrA,
+  LdAC,
+  LdCA,
+  AluR8,
+  AluImm,
+  IncR8,
+  DecR8,
+  IncR16,
+  DecR16,
+  // CB prefixed ops on r8 a. b is the operation for Shift (RLC, RRC, RL, RR,
+  // SLA, SRA, SWAP, SRL, in opcode order), and the bit for the others
+  Shift,
+  Bit,
+  Res,
+  Set,
+  // JR cc, JP cc, and the not taken side of CALL cc and RET cc: leaves the
+  // block at imm, with b cycles on top, if condition a holds. See
+  // emit_conditional_exit
+  ConditionalExit,
+  // see emit_cycle_check
+  CycleCheck,
+  // start of a copy or fill loop, see emit_bulk_loop
+  BulkLoop,
+  // PUSH r16 / POP r16, a = gp3 register, see emit_push_u16
+  Push,
+  Pop,
+  // CALL or RST pushing return address imm onto the guest stack
+  PushImm,
+  // RET, or RETI if a is set. core.pc is only known at run time after it
+  Ret,
+  // CALL or RST returning to imm, see emit_push_return
+  PushReturn,
+  // end of the block, linkable if a is set
+  Exit,
+};
+
+// How an Exit whose next pc is only known at run time gets to the next block
+// without going through run_block, see emit_indirect_exit
+enum class IndirectExit {
+  None,
+  Jump,
+  Return,
+  // RETI, which has to go back to run_frame if an interrupt is pending
+  ReturnFromInterrupt,
+};
+
+// core.pc is only known at run time
+constexpr int32_t PC_DYNAMIC = -1;
+
+struct IRInst {
+  IROp op;
+  // r8/r16 operands (or ALU operation and operand), fallback parameters
+  int a = 0;
+  int b = 0;
+  // immediate, address known at compile time, or pc compared against
+  uint16_t imm = 0;
+  // address right after the opcode, where fallbacks expect core.pc
+  uint16_t operand_pc = 0;
+  // core.pc once the instruction is done, if known at compile time
+  int32_t next_pc = PC_DYNAMIC;
+  // static cycles of the block up to and including this instruction
+  int cycles = 0;
+  void* fallback = nullptr;
+  int params = 0;
+  BranchProfile* profile = nullptr;
+  // exit to the start of an idle loop, see emit_idle_skip
+  bool idle_skip = false;
+  // guest flags something after this instruction still reads
+  uint8_t live_flags = 0xF0;
+  // removed by optimize_ir
+  bool dead = false;
+  IndirectExit indirect = IndirectExit::None;
+  BulkLoop bulk = {};
+};
+
+// Entry of the shadow return-address stack: the return address a CALL or RST
+// pushed, and a linkable exit to it in the caller's code
+struct ReturnPrediction {
+  uint16_t pc = 0;
+  const uint8_t* landing = nullptr;
+};
+
+// Guest state in the middle of a block, as recorded after each memory call
+// (see emit_memory_call): core.pc once the instruction is done
+struct GuestState {
+  uint16_t pc;
+};
+
+enum class RegAccess { Read, Write, ReadWrite };
+
+// Guest registers (in r8 order, followed by SP) currently held in their host
+// register, and which of those have been modified, while compiling a block
+constexpr int SP_SLOT = 8;
+struct GuestRegs {
+  std::array<bool, 9> loaded{};
+  std::array<bool, 9> dirty{};
+};
+
+// One per Core using the cached interpreter, so that any number of cores can
+// run in the same process, each on its own thread
 class GBCachedInterpreter {
 public:
-  inline static block_fp* block_page_table[0xffff >> PAGE_SHIFT];
-  inline static x64Emitter code;
+  explicit GBCachedInterpreter(const Config& config);
+  ~GBCachedInterpreter();
+  GBCachedInterpreter(const GBCachedInterpreter&) = delete;
+  GBCachedInterpreter& operator=(const GBCachedInterpreter&) = delete;
+
+  Block* block_page_table[0x10000 >> PAGE_SHIFT]{};
+  // blocks whose code overlaps each code page. Core::code_bitmap has a bit set
+  // for each page with a nonempty list
+  std::vector<Block*> page_blocks[0x10000 >> PAGE_SHIFT];
+  // block_page_table entries for 0x4000-0x7FFF of every ROM bank not currently
+  // mapped, indexed by bank. The mapped bank's entries live in block_page_table
+  std::vector<std::array<Block*, (0x4000 >> PAGE_SHIFT)>> rom_bank_pages;
+  uint32_t mapped_rom_bank = 1;
+  // blocks in 0x4000-0x7FFF that other blocks link into
+  std::vector<Block*> banked_link_targets;
+  // by rom_key of the branch instruction. Nodes stay put, so emitted code can
+  // count into them directly
+  std::unordered_map<uint32_t, BranchProfile> branch_profiles;
+
+  // Persistent translation cache (see Config::translation_cache_dir). Blocks
+  // compiled from cartridge ROM, as bank << 16 | address, with bank 0 for
+  // 0x0000-0x3FFF. Only the guest addresses are kept, the blocks themselves
+  // are emitted again on load
+  std::string translation_cache_path;
+  std::set<uint32_t> translated_blocks;
+  // see Config::perf_map
+  std::ofstream perf_map;
+  // by stats_key. Updated from both threads, under stats_mutex
+  std::atomic<bool> block_stats_enabled = false;
+  std::mutex stats_mutex;
+  std::unordered_map<uint32_t, BlockStats> block_stats;
+  // how much of the code cache we may use, see Config::code_cache_size
+  size_t cache_size;
+  x64Emitter code;
+  // see emit_dispatcher. Emitted again after every flush_cache
+  const uint8_t* dispatcher = nullptr;
+
+  // Set by the exit stub of a linkable exit, to be patched once we know which
+  // block comes next. Points right past the rel32 of the exit's jmp
+  uint8_t* pending_link = nullptr;
+  // Set by the miss stub of an indirect exit, same as pending_link. The pc
+  // its cache compares against is right before the jmp (see
+  // emit_indirect_exit)
+  uint8_t* pending_indirect = nullptr;
+  // Shadow return-address stack, indexed by return_stack_top modulo its size.
+  // Deep call chains wrap around and overwrite the oldest entries
+  std::array<ReturnPrediction, RETURN_STACK_SIZE> return_stack{};
+  uint32_t return_stack_top = 0;
+  PendingFlags pending_flags;
+  GuestRegs guest_regs;
+  // flags the instruction being emitted has to produce, see emit_defer_flags
+  uint8_t live_flags = 0xF0;
+  // value of core.pc at this point of the block being compiled, if known
+  int32_t synced_pc = PC_DYNAMIC;
+  // of the instruction being emitted
+  GuestState guest_state{};
+  // block being compiled, see recompile_block
+  std::vector<IRInst> ir;
+  // where the guest code being compiled is read from, see fetch_u8
+  bool compile_in_rom = false;
+  uint32_t compile_bank = 1;
+  bool compile_bootrom = false;
+
+  // Tiered execution, see Config::background_compile
+  std::thread compile_thread;
+  std::mutex compile_mutex;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::deque<CompileRequest> compile_queue;
+  bool stop_compiling = false;
+  // set by the compile thread when it can't fit another block, for the
+  // dispatcher to flush the code cache once no emitted code is running
+  std::atomic<bool> cache_full = false;
+  // bumped on every flush_cache
+  uint32_t cache_generation = 0;
+  // core.pc after the last instruction run_cold interpreted, if it simply
+  // went on to the next one
+  int32_t interp_next_pc = PC_DYNAMIC;
 
   // Get offset from a variable to the cpu core
-  static uintptr_t inline get_offset(Core& core, void* variable) {
+  static uintptr_t inline get_offset(Core& core, const void* variable) {
     return (uintptr_t)variable - (uintptr_t)&core;
   }
 
   // Check if code cache is close to being exhausted
-  static void check_emitted_cache() {
+  void check_emitted_cache(Core& core) {
     if (code.getSize() + CACHE_LEEWAY >
-        CACHE_SIZE) { // We've nearly exhausted code cache, so throw it out
-      code.reset();
-      memset(block_page_table, 0, sizeof(block_page_table));
-      PANIC("Code Cache Exhausted!!\n");
+        cache_size) { // We've nearly exhausted code cache, so throw it out
+      flush_cache(core);
     }
   }
 
 public:
-  static void emit_prologue(Core& core);
-  static void emit_epilogue(Core& core);
-  static block_fp recompile_block(Core& core);
-  static void emit_fallback_no_params(no_params_fp fallback, Core& core);
-  static void emit_fallback_one_params(one_params_fp fallback, Core& core,
-                                       int first);
-  static void emit_fallback_two_params(two_params_fp fallback, Core& core,
-                                       int first, int second);
+  void emit_prologue(Core& core);
+  void emit_epilogue(Core& core);
+  void recompile_block(Core& core, Block& block, uint16_t start, uint32_t bank,
+                       bool bootrom_enabled, bool trace = false);
+  void set_block_stats(bool enabled);
+  std::vector<std::pair<uint32_t, BlockStats>> get_block_stats();
+  std::string block_stats_report(size_t top_n);
+  // rom_key for cartridge ROM, 0xFFFF << 16 | address for RAM
+  static uint32_t stats_key(bool in_rom, uint16_t addr, uint32_t bank) {
+    return in_rom ? rom_key(addr, bank) : 0xFFFFu << 16 | addr;
+  }
+  void write_perf_map(block_fp fp, size_t size, uint16_t start, uint32_t bank,
+                      bool trace);
+  uint8_t fetch_u8(Core& core, uint16_t addr);
+  uint16_t fetch_u16(Core& core, uint16_t addr);
+  void optimize_ir(Core& core, const Block& block);
+  void emit_ir(Core& core, Block& block);
+  void emit_sync_pc(Core& core, uint16_t pc);
+  void emit_dispatcher(Core& core);
+  void emit_link_guard(Core& core, Xbyak::Label& exit);
+  void emit_block_exit(Core& core, bool linkable);
+  void emit_indirect_exit(Core& core, IndirectExit kind);
+  void emit_push_return(Core& core, uint16_t return_pc, Xbyak::Label& landing);
+  void link_indirect(uint8_t* link, Block& target);
+  void emit_side_exit(Core& core, int static_cycles, bool linkable,
+                      int32_t exit_pc = PC_DYNAMIC, bool idle_skip = false);
+  void emit_cycle_check(Core& core, int static_cycles, uint16_t exit_pc);
+  void emit_skip_unless(Core& core, int condition, Xbyak::Label& skip);
+  void emit_conditional_exit(Core& core, const IRInst& inst);
+  bool is_idle_loop(Core& core, uint16_t start);
+  bool is_bulk_loop(Core& core, uint16_t start, BulkLoop& loop);
+  void emit_bulk_loop(Core& core, const BulkLoop& loop);
+  void emit_idle_skip(Core& core, int iteration_cycles);
+  void link_block(uint8_t* link, Block& target);
+  void unlink_block(Block& block);
+  void emit_fallback_no_params(no_params_fp fallback, Core& core);
+  void emit_fallback_one_params(one_params_fp fallback, Core& core, int first);
+  void emit_fallback_two_params(two_params_fp fallback, Core& core, int first,
+                                int second);
+
+  // Native code generation. Guest registers are cached in host registers
+  // (see get_r8), and memory is accessed through Core::read_pages and
+  // Core::write_pages (see emit_read_u8)
+  Xbyak::Address get_r8_address(Core& core, int r8);
+  Xbyak::Reg8 get_r8(Core& core, int r8, RegAccess access);
+  Xbyak::Reg16 get_sp(Core& core, RegAccess access);
+  void emit_writeback_regs(Core& core);
+  void emit_memory_call(Core& core, void* fn);
+  static GuestState guest_state_at(const void* return_address);
+  void emit_r16_address(Core& core, int gp1);
+  Xbyak::Address get_host_byte(Core& core, uint8_t* host);
+  void emit_read_u8(Core& core);
+  void emit_write_u8(Core& core);
+  void emit_update_flags(Core& core, uint8_t from_host, uint8_t set,
+                         uint8_t keep);
+  void emit_defer_flags(Core& core, uint8_t from_host, uint8_t set,
+                        uint8_t keep);
+  void emit_flush_flags(Core& core);
+  void emit_load_carry(Core& core);
+  void emit_ld_a_r16_addr(Core& core, int gp2);
+  void emit_ld_r16_addr_a(Core& core, int gp2);
+  void emit_hl_step(Core& core, int gp2);
+  void emit_ld_a_addr(Core& core, uint16_t addr);
+  void emit_ld_addr_a(Core& core, uint16_t addr);
+  void emit_ld_a_c(Core& core);
+  void emit_ld_c_a(Core& core);
+  void emit_ld_r8_r8(Core& core, int dest, int src);
+  void emit_ld_r8_u8(Core& core, int dest, uint8_t imm);
+  void emit_ld_r16_u16(Core& core, int gp1, uint16_t imm);
+  void emit_alu_a(Core& core, int op);
+  void emit_alu_a_r8(Core& core, int op, int r8);
+  void emit_alu_a_u8(Core& core, int op, uint8_t imm);
+  void emit_inc_r8(Core& core, int r8);
+  void emit_dec_r8(Core& core, int r8);
+  void emit_inc_r16(Core& core, int gp1);
+  void emit_dec_r16(Core& core, int gp1);
+  void emit_shift(Core& core, int op, Xbyak::Reg8 reg);
+  void emit_shift_r8(Core& core, int op, int r8);
+  void emit_bit_r8(Core& core, int bit, int r8);
+  void emit_res_set_r8(Core& core, int bit, int r8, bool set);
+  void emit_push_u16(Core& core, Xbyak::Reg8 lo, Xbyak::Reg8 hi);
+  void emit_pop_u16(Core& core, Xbyak::Reg8 lo, Xbyak::Reg8 hi);
+  void emit_push_r16(Core& core, int gp3);
+  void emit_pop_r16(Core& core, int gp3);
+  void emit_push_imm(Core& core, uint16_t value);
+  void emit_ret(Core& core, bool reti);
+  // Core::decode_execute_func, runs the block at core.pc (see run_block)
   static int decode_execute(Core& core);
-  static void invalidate_page(uint16_t addr);
+  int run_block(Core& core);
+  int run_cold(Core& core, Block& block);
+  void compile_worker();
+  static block_fp load_fp(Block& block) {
+    return std::atomic_ref(block.fp).load(std::memory_order_acquire);
+  }
+  static void publish_fp(Block& block, block_fp fp) {
+    std::atomic_ref(block.fp).store(fp, std::memory_order_release);
+  }
+  void register_block(Core& core, Block& block);
+  void invalidate_block(Core& core, Block& block);
+  void invalidate(Core& core, uint32_t start, uint32_t end);
+  void switch_rom_bank(uint32_t bank);
+  static bool in_cartridge_rom(uint16_t addr, bool bootrom_enabled) {
+    return addr < 0x8000 && !(bootrom_enabled && addr < 0x100);
+  }
+  static bool in_cartridge_rom(Core& core, uint16_t addr) {
+    return in_cartridge_rom(addr, core.bootrom_enabled);
+  }
+  // identifies an address in cartridge ROM as bank << 16 | address, with bank
+  // 0 for 0x0000-0x3FFF
+  uint32_t rom_key(uint16_t addr) const {
+    return rom_key(addr, mapped_rom_bank);
+  }
+  static uint32_t rom_key(uint16_t addr, uint32_t bank) {
+    return (addr >= 0x4000 ? bank : 0) << 16 | addr;
+  }
+  Block& get_block(uint16_t addr);
+  Block& get_block(uint16_t addr, uint32_t bank);
+  void load_translation_cache(Core& core, const char* dir);
+  void save_translation_cache();
+  void flush_cache(Core& core);
 };
@@ -33,6 +33,11 @@ static constexpr bool in_between(uint32_t start, uint32_t end, uint32_t addr) {
   return addr >= start && addr <= end;
 }
 
+// size of cache pages
+constexpr int PAGE_SIZE = 32;
+// shift required to get page from a given address = ctz(page_size)
+constexpr int PAGE_SHIFT = 5;
+
 // clang-format off
 static int regular_instr_timing[256] = {
 	  1, 3, 2, 2, 1, 1, 2, 1, 5, 2, 2, 2, 1, 1, 2, 1,
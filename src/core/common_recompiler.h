@@ -1,32 +1,45 @@
 #pragma once
 
+#include "common.h"
 #include <xbyak/xbyak.h>
 
 using namespace Xbyak::util;
 using block_fp = int64_t (*)();
 // using interpreterfp = void (*)(Core&, uint16_t);
-static constexpr int CACHE_SIZE = 512 * 1024 * 1024;
+// Upper bound on Config::code_cache_size
+static constexpr size_t CACHE_SIZE = 512 * 1024 * 1024;
 
-// If current_cache_size + cache_leeway > cache_size, reset cache
-static constexpr int CACHE_LEEWAY = 1024;
+// If current_cache_size + cache_leeway > cache_size, reset cache. Has to fit
+// the largest block we can emit
+static constexpr size_t CACHE_LEEWAY = 64 * 1024;
+
+// Longest a block may get, in guest instructions. Keeps the largest block we
+// can emit well within CACHE_LEEWAY
+static constexpr int MAX_BLOCK_INSTRUCTIONS = 128;
+
+// How many times a block in cartridge ROM has to be dispatched before it gets
+// recompiled as a trace
+static constexpr uint32_t TRACE_THRESHOLD = 16;
+
+// How many times code in cartridge ROM has to be dispatched before it gets
+// queued for the compile thread, see Config::background_compile
+static constexpr uint32_t TIER_UP_THRESHOLD = 4;
+
+// Entries of the shadow return-address stack, see
+// GBCachedInterpreter::emit_push_return. Has to be a power of two
+static constexpr uint32_t RETURN_STACK_SIZE = 32;
 
 // The entire code emitter. God bless xbyak
 
 class x64Emitter : public Xbyak::CodeGenerator {
 public:
-  // emitted code cache
-  uint8_t cache[CACHE_SIZE] = {};
-  x64Emitter() : CodeGenerator(CACHE_SIZE) { // Initialize emitter and memory
+  explicit x64Emitter(size_t size)
+      : CodeGenerator(size) { // Initialize emitter and memory
     setProtectMode(
         PROTECT_RWE); // Mark emitter memory as readadable/writeable/executable
   }
 };
 
-// size of cache pages
-constexpr int PAGE_SIZE = 32;
-// shift required to get page from a given address = ctz(page_size)
-constexpr int PAGE_SHIFT = 5;
-
 // Register definitions (TODO: make this work with the Windows ABI!!)
 const auto RETURN = eax;
 const auto PARAM1 = rdi;
@@ -34,3 +47,16 @@ const auto PARAM2 = rsi;
 const auto PARAM3 = rdx;
 const auto SAVED1 = r12;
 const auto SAVED2 = r13;
+
+// Host registers guest registers are cached in while a block runs, in r8 order:
+// B, C, D, E, H, L, (HL), A. (HL) is never cached, so its entry is unused.
+// Everything is written back before calling into the interpreter, which is why
+// caller saved registers can be used here
+const Xbyak::Reg8 HOST_R8[8] = {r14b, r15b, r8b, r9b, r10b, r11b, al, bl};
+const auto HOST_SP = si;
+
+// Guest flag masks, as laid out in the F register
+constexpr uint8_t FLAG_Z = 1 << 7;
+constexpr uint8_t FLAG_N = 1 << 6;
+constexpr uint8_t FLAG_H = 1 << 5;
+constexpr uint8_t FLAG_C = 1 << 4;
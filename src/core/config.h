@@ -10,4 +10,24 @@ public:
   const char* rom_path;
   const char* bootrom_path;
   CPUTypes cpu_type;
+  // upper bound on the memory used for emitted code by the cached interpreter.
+  // Once it's used up, all compiled blocks are thrown out and recompiled on
+  // demand. Capped at CACHE_SIZE
+  size_t code_cache_size = 32 * 1024 * 1024;
+  // directory the cached interpreter keeps its translation caches in, one file
+  // per ROM, named after its hash. They list the blocks compiled from
+  // cartridge ROM in earlier runs, which get compiled on start. nullptr
+  // disables them
+  const char* translation_cache_dir = nullptr;
+  // the cached interpreter interprets code in cartridge ROM until it's hot,
+  // and compiles it on a thread of its own in the meantime. Otherwise,
+  // everything is compiled right before it first runs
+  bool background_compile = true;
+  // the cached interpreter appends every block it emits to
+  // /tmp/perf-<pid>.map, named after its guest address, so perf and other
+  // profilers that read perf maps can attribute time spent in emitted code
+  bool perf_map = false;
+  // whether the cached interpreter starts out collecting per-block statistics,
+  // see GBCachedInterpreter::set_block_stats
+  bool block_stats = false;
 };
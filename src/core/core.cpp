@@ -3,6 +3,7 @@
 #include "common.h"
 #include "interpreter.h"
 #include "mbc.h"
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
@@ -37,6 +38,7 @@ Core::Core(Config config, std::vector<bool>& input)
       break;
     case CPUTypes::CACHED_INTERPRETER:
       decode_execute_func = GBCachedInterpreter::decode_execute;
+      jit = std::make_unique<GBCachedInterpreter>(config);
       break;
   }
 
@@ -69,6 +71,18 @@ Core::Core(Config config, std::vector<bool>& input)
   } else {
     load_bootrom(config.bootrom_path);
   }
+
+  map_pages();
+
+  if (jit && config.translation_cache_dir) {
+    jit->load_translation_cache(*this, config.translation_cache_dir);
+  }
+}
+
+Core::~Core() {
+  if (jit) {
+    jit->save_translation_cache();
+  }
 }
 
 void Core::load_rom(const char* path) {
@@ -88,6 +102,36 @@ void Core::load_bootrom(const char* path) {
   file.read((char*)(bootrom.data()), sizeof(uint8_t) * 0x100);
 }
 
+void Core::map_page(uint8_t page) {
+  const uint16_t addr = page << 8;
+  uint8_t* read = nullptr;
+  uint8_t* write = nullptr;
+
+  if (in_between(0x0000, 0x7FFF, addr)) {
+    // writes here are MBC register writes
+    if (bootrom_enabled && page == 0) {
+      read = &bootrom[0];
+    } else {
+      read = &mbc.mem_reference<false, uint8_t>(addr);
+    }
+  } else if (in_between(0x8000, 0x9FFF, addr)) {
+    read = write = &vram[addr - 0x8000];
+  } else if (in_between(0xC000, 0xDFFF, addr)) {
+    read = write = &wram[addr - 0xC000];
+  } else if (in_between(0xE000, 0xFDFF, addr)) {
+    read = &wram[addr - 0xE000];
+  }
+
+  read_pages[page] = read;
+  write_pages[page] = code_bitmap[page] ? nullptr : write;
+}
+
+void Core::map_pages() {
+  for (int page = 0; page < 0x100; page++) {
+    map_page(page);
+  }
+}
+
 // NOTE: Type punning is used for reading and writing. This is not portable to a
 // BE host sytem
 
@@ -128,7 +172,9 @@ template uint32_t Core::mem_read<uint32_t>(uint16_t addr);
 template <bool Write>
 uint8_t& Core::mem_byte_reference(uint16_t addr, uint8_t value) {
   if constexpr (Write) {
-    GBCachedInterpreter::invalidate_page(addr);
+    if (has_code(addr)) {
+      jit->invalidate(*this, addr, addr + 1);
+    }
   }
 
   if (in_between(0x0000, 0x7FFF, addr)) {
@@ -170,7 +216,10 @@ template uint8_t& Core::mem_byte_reference<true>(uint16_t addr, uint8_t value);
 
 template <typename T>
 void Core::mem_write(uint16_t addr, T value) {
-  GBCachedInterpreter::invalidate_page(addr);
+  const uint16_t last = addr + sizeof(T) - 1;
+  if (has_code(addr) || has_code(last)) {
+    jit->invalidate(*this, addr, addr + sizeof(T));
+  }
 
   if (in_between(0x0000, 0x7FFF, addr)) {
     mbc.mem_reference<true, T>(addr, value) = value;
@@ -198,6 +247,12 @@ template void Core::mem_write<uint32_t>(uint16_t addr, uint32_t value);
 
 template <bool Write>
 uint8_t& Core::handle_mmio(uint16_t addr, uint8_t value) {
+  if constexpr (Write) {
+    if (moves_next_event(addr) || requests_interrupt(addr, value)) {
+      cycle_budget = 0;
+    }
+  }
+
   switch (addr) {
     case 0xFF00:
       // first we are written to, to select which part of the input we are
@@ -242,8 +297,12 @@ uint8_t& Core::handle_mmio(uint16_t addr, uint8_t value) {
       return STUB;
     case 0xFF50:
       if constexpr (Write) {
-        if (value != 0) {
+        if (value != 0 && bootrom_enabled) {
           bootrom_enabled = false;
+          if (jit) {
+            jit->invalidate(*this, 0x0000, 0x0100);
+          }
+          map_page(0);
         }
       }
       return STUB;
@@ -295,6 +354,28 @@ uint8_t& Core::handle_mmio(uint16_t addr, uint8_t value) {
 template uint8_t& Core::handle_mmio<false>(uint16_t addr, uint8_t value);
 template uint8_t& Core::handle_mmio<true>(uint16_t addr, uint8_t value);
 
+// The byte handle_mmio reads or writes for addr, if accessing the register does
+// nothing else. nullptr for registers with side effects, which have to go
+// through handle_mmio
+uint8_t* Core::mmio_storage(uint16_t addr, bool write) {
+  if (write && may_zero_budget(addr)) {
+    return nullptr;
+  }
+
+  switch (addr) {
+    case 0xFF00:
+      // reads sample the input
+      return write ? &JOYP_WRITE : nullptr;
+    case 0xFF04:
+      return write ? nullptr : &DIV;
+    case 0xFF46:
+    case 0xFF50:
+      return write ? nullptr : &STUB;
+    default:
+      return &handle_mmio<false>(addr);
+  }
+}
+
 bool Core::get_flag(Regs::Flag f) {
   switch (f) {
     case Regs::Flag::Z:
@@ -333,19 +414,20 @@ void Core::set_flag(Regs::Flag f, bool value) {
   }
 }
 
+// TIMA increment period in cycles, indexed by the clock select bits of TAC
+static constexpr int timer_periods[] = {1024, 16, 64, 256};
+
 void Core::tick_timers(int ticks) {
-  static int internal_clock = 0;
-  static int hz[] = {1024, 16, 64, 256};
-  int select = hz[TAC & 0x3];
+  int select = timer_periods[TAC & 0x3];
 
   for (int i = 0; i < ticks; i++) {
-    internal_clock++;
-    if (internal_clock % 256 == 0) {
+    timer_clock++;
+    if (timer_clock % 256 == 0) {
       DIV++;
     }
 
     if (BIT(TAC, 2)) {
-      if (internal_clock % select == 0) {
+      if (timer_clock % select == 0) {
         if (TIMA == 0xFF) {
           TIMA = TMA;
           IF |= 1 << 2;
@@ -364,7 +446,8 @@ int Core::handle_interrupts() {
         IME = false;
         IF &= ~(1 << i);
 
-        static uint16_t int_vectors[] = {0x40, 0x48, 0x50, 0x58, 0x60};
+        static constexpr uint16_t int_vectors[] = {0x40, 0x48, 0x50, 0x58,
+                                                   0x60};
         sp -= 2;
         mem_write<uint16_t>(sp, pc);
 
@@ -377,6 +460,18 @@ int Core::handle_interrupts() {
   return 0;
 }
 
+int Core::cycles_until_next_event(int frame_cycles_left) const {
+  int cycles = std::min(frame_cycles_left, ppu.cycles_until_next_event());
+
+  if (BIT(TAC, 2)) {
+    // lower bound on when TIMA overflows, as the next increment may be only a
+    // cycle away
+    cycles = std::min(cycles, (0xFF - TIMA) * timer_periods[TAC & 0x3] + 1);
+  }
+
+  return cycles;
+}
+
 void Core::run_frame() {
   // the amount of cpu cycles to execute per frame
   // all other components are synced to this
@@ -387,6 +482,7 @@ void Core::run_frame() {
 
     if (!HALT) {
       // PRINT("PC: 0x{:04X}\n", pc);
+      cycle_budget = cycles_until_next_event(cycles_to_execute);
       cycles_taken = decode_execute_func(*this);
 
       // enable interrupt from EI after the next instruction
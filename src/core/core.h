@@ -5,6 +5,9 @@
 #include "mbc.h"
 #include <array>
 #include <cstdint>
+#include <memory>
+
+class GBCachedInterpreter;
 
 namespace Regs {
 enum Regs { AF = 0, BC, DE, HL };
@@ -32,6 +35,7 @@ public:
     std::array<uint32_t, 4> colors = {0xe0f8d0, 0x88c070, 0x346856, 0x081820};
 
     void tick(int cycles);
+    int cycles_until_next_event() const;
     int WLC = 0;
 
     void draw_bg();
@@ -58,9 +62,35 @@ public:
   uint8_t TIMA = 0;
   uint8_t TMA = 0;
   uint8_t TAC = 0;
+  // T-cycles since power on, DIV and TIMA count off of it
+  int timer_clock = 0;
   void tick_timers(int ticks);
   int handle_interrupts();
 
+  // how many cycles the cpu may run ahead before the other components need to
+  // catch up. Used by the cached interpreter to bound chains of linked blocks
+  int64_t cycle_budget = 0;
+  int cycles_until_next_event(int frame_cycles_left) const;
+  // I/O registers that move the next event when written: TIMA, TMA, TAC and
+  // LCDC. Writing them zeroes cycle_budget, so that emitted code returns to
+  // run_frame to compute it again
+  static bool moves_next_event(uint16_t addr) {
+    return in_between(0xFF05, 0xFF07, addr) || addr == 0xFF40;
+  }
+  // Whether writing value to IF or IE requests an interrupt that can be
+  // serviced right away. That zeroes cycle_budget as well
+  bool requests_interrupt(uint16_t addr, uint8_t value) const {
+    if (!IME) {
+      return false;
+    }
+    return (addr == 0xFF0F && value & IE & 0x1F) ||
+           (addr == 0xFFFF && IF & value & 0x1F);
+  }
+  // I/O registers whose writes may zero cycle_budget, see the two above
+  static bool may_zero_budget(uint16_t addr) {
+    return moves_next_event(addr) || addr == 0xFF0F || addr == 0xFFFF;
+  }
+
   // memory
   bool bootrom_enabled = true;
   std::vector<uint8_t> bootrom;
@@ -72,6 +102,22 @@ public:
   std::vector<uint8_t> oam;
   std::vector<uint8_t> hram;
 
+  // Host pointers to each 256 byte page of guest memory, so the cached
+  // interpreter can access memory without calling into the core. nullptr means
+  // the access has to go through mem_read/mem_write: MMIO, MBC registers,
+  // external RAM, and writes to pages that hold compiled code
+  std::array<uint8_t*, 0x100> read_pages{};
+  std::array<uint8_t*, 0x100> write_pages{};
+  // One bit per code page (see PAGE_SIZE), set while compiled blocks cover it.
+  // Each byte covers a 256 byte page, so a page with any code in it is simply
+  // a nonzero byte
+  std::array<uint8_t, 0x100> code_bitmap{};
+  bool has_code(uint16_t addr) const {
+    return code_bitmap[addr >> 8] >> (addr >> PAGE_SHIFT & 7) & 1;
+  }
+  void map_page(uint8_t page);
+  void map_pages();
+
   // memory read/write functions
   template <typename T>
   T mem_read(uint16_t addr);
@@ -81,6 +127,7 @@ public:
   void mem_write(uint16_t addr, T value);
   template <bool Write>
   uint8_t& handle_mmio(uint16_t addr, uint8_t value = 0);
+  uint8_t* mmio_storage(uint16_t addr, bool write);
 
   // cartridge functions
   void load_bootrom(const char* path);
@@ -107,9 +154,12 @@ public:
 
   using DecodeExecuteFunc = int (*)(Core& core);
   DecodeExecuteFunc decode_execute_func;
+  // only set when running on the cached interpreter
+  std::unique_ptr<GBCachedInterpreter> jit;
 
 public:
   Core(Config config, std::vector<bool>& input);
+  ~Core();
   void run_frame();
   [[nodiscard]] const auto& get_fb_ref() const { return fb; }
 
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "core.h"
+#include <atomic>
 #include <chrono>
 #include <functional>
 #include <numeric>
@@ -17,6 +18,8 @@ private:
   std::function<void()> wait_for_ui_thread;
   std::function<void()> ping_ui_thread;
 
+  std::atomic<bool> stop_requested = false;
+
 public:
   CoreWrapper(Config config, std::function<void()> start,
               std::function<void()> end)
@@ -31,6 +34,9 @@ public:
 
     while (true) {
       wait_for_ui_thread();
+      if (stop_requested) {
+        return;
+      }
 
       start_time = std::chrono::high_resolution_clock::now();
       core.run_frame();
@@ -42,6 +48,10 @@ public:
     }
   }
 
+  // makes run return before its next frame. The ui thread still has to wake
+  // it up, in case it is waiting for a frame
+  void stop() { stop_requested = true; }
+
   // TODO: implement double buffering to reduce/eliminate screen tearing
   [[nodiscard]] const auto& get_fb_ref() const { return core.get_fb_ref(); }
   [[nodiscard]] auto get_frame_time() const { return frame_time; }
@@ -59,7 +59,6 @@ static constexpr uint16_t& get_group_3(Core& core, int gp3) {
       return core.regs[Regs::HL];
       break;
     case 3:
-      core.regs[Regs::AF] &= 0xfff0;
       return core.regs[Regs::AF];
       break;
     default:
@@ -269,6 +268,10 @@ int GBInterpreter::push_r16(Core& core, uint8_t gp3) {
 
 int GBInterpreter::pop_r16(Core& core, uint8_t gp3) {
   get_group_3(core, gp3) = core.mem_read<uint16_t>(core.sp);
+  if (gp3 == 3) {
+    // the low nibble of F always reads as 0
+    core.regs[Regs::AF] &= 0xFFF0;
+  }
   core.sp += 2;
   return 0;
 }
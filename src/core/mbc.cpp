@@ -49,13 +49,16 @@ T& MBC::mem_reference(uint16_t addr, uint8_t value) {
     if (in_between(0x0000, 0x7FFF, addr)) {
       // handle MBC registers
       if (in_between(0x2000, 0x3FFF, addr)) {
-        auto old = mbc1regs.rom_bank_number;
+        auto old = rom_bank();
         mbc1regs.rom_bank_number = value & 0x1f;
 
-        // invalidate all pages that refer to the old rom bank number
-        if (old != mbc1regs.rom_bank_number) {
-          for (int i = 0x4000; i < 0x8000; i += 1 << PAGE_SHIFT) {
-            GBCachedInterpreter::invalidate_page(i);
+        // swap in the blocks compiled from the new bank
+        if (old != rom_bank()) {
+          if (core.jit) {
+            core.jit->switch_rom_bank(rom_bank());
+          }
+          for (int page = 0x40; page < 0x80; page++) {
+            core.map_page(page);
           }
         }
       }
@@ -71,11 +74,7 @@ T& MBC::mem_reference(uint16_t addr, uint8_t value) {
       return *(T*)(&rom[addr]);
 
     } else if (in_between(0x4000, 0x7FFF, addr)) {
-      uint32_t bank =
-          (mbc1regs.rom_bank_number) == 0
-              ? 1
-              : mbc1regs.rom_bank_number & (~(0xff << (rom_size + 1)));
-      uint32_t new_addr = (addr - 0x4000) + (bank * 0x4000);
+      uint32_t new_addr = (addr - 0x4000) + (rom_bank() * 0x4000);
       return *(T*)(&rom[new_addr]);
 
     } else if (in_between(0xA000, 0xBFFF, addr)) {
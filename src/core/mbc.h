@@ -38,6 +38,31 @@ class MBC {
 public:
   MBC(Core& core, const char* rom_path);
 
+  // FNV-1a hash of the whole ROM
+  uint64_t rom_hash() const {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (auto byte : rom) {
+      hash = (hash ^ byte) * 0x100000001b3;
+    }
+    return hash;
+  }
+
+  // byte at addr in 0x0000-0x7FFF, with bank mapped to 0x4000-0x7FFF. ROM never
+  // changes, so this is safe to call from any thread
+  uint8_t rom_read(uint32_t bank, uint16_t addr) const {
+    return rom[addr < 0x4000 ? addr : (addr - 0x4000) + bank * 0x4000];
+  }
+
+  // 16KB banks in the ROM, counting bank 0
+  uint32_t rom_banks() const { return rom.size() / 0x4000; }
+
+  // ROM bank currently mapped to 0x4000-0x7FFF
+  uint32_t rom_bank() const {
+    return mbc1regs.rom_bank_number == 0
+               ? 1
+               : mbc1regs.rom_bank_number & (~(0xff << (rom_size + 1)));
+  }
+
   template <bool Write, typename T>
   T& mem_reference(uint16_t addr, uint8_t value = 0);
 };
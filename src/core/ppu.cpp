@@ -2,6 +2,7 @@
 #include "core.h"
 #include <algorithm>
 #include <array>
+#include <climits>
 #include <cstdint>
 
 void Core::PPU::tick(int cycles) {
@@ -85,6 +86,24 @@ void Core::PPU::tick(int cycles) {
   }
 }
 
+int Core::PPU::cycles_until_next_event() const {
+  if (!BIT(core.LCDC, 7)) {
+    return INT_MAX;
+  }
+
+  switch (mode) {
+    case PPUMode::OAMScan:
+      return 80 - dot_clock;
+    case PPUMode::DrawingPixels:
+      return 172 - dot_clock;
+    case PPUMode::HBlank:
+      return 204 - dot_clock;
+    case PPUMode::VBlank:
+      return 456 - dot_clock;
+  }
+  return 0;
+}
+
 void Core::PPU::draw_scanline() {
   draw_bg();
   draw_sprites();
@@ -9,6 +9,7 @@
 #include <SFML/Graphics/Texture.hpp>
 #include <SFML/Window.hpp>
 #include <cmath>
+#include <csignal>
 #include <condition_variable>
 #include <mutex>
 #include <string>
@@ -106,7 +107,7 @@ public:
   }
 
   void run() {
-    while (window.isOpen()) {
+    while (window.isOpen() && !stop_requested) {
       ping_core_thread();
 
       // TODO: double buffering
@@ -121,10 +122,15 @@ public:
       wait_for_core_thread();
     }
 
-    exit(0);
+    stop_core_thread();
   }
 
+  // set from a signal handler to have run return, so the core gets destroyed
+  // normally instead of from the handler
+  static inline volatile std::sig_atomic_t stop_requested = 0;
+
   void draw_imgui_windows();
+  [[nodiscard]] const Core& get_core_ref() const { return core.get_core_ref(); }
 
   // we ping the core thread, which then runs for one frame. the core
   // frame then pings back once frame execution is finished
@@ -138,6 +144,16 @@ public:
     // PRINT("FRAME START\n");
   }
 
+  void stop_core_thread() {
+    core.stop();
+    {
+      std::lock_guard<std::mutex> lock(mutex_run_frame);
+      run_frame = true;
+    }
+    condvar_run_frame.notify_one();
+    core_thread.join();
+  }
+
   void wait_for_core_thread() {
     if (!this->is_framerate_limited) {
       return;
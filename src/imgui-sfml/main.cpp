@@ -5,24 +5,11 @@
 #include <fstream>
 #include <iostream>
 
-// Function to handle Ctrl+C signal
+// Function to handle Ctrl+C signal. Only sets a flag: the core thread may be
+// in the middle of a frame, so the cleanup happens once Frontend::run returns
 void signal_handler(int signal) {
   if (signal == SIGINT) {
-    std::cout << "Ctrl+C received. Performing final cleanup..." << std::endl;
-
-    // Open a file for writing in binary mode
-    std::ofstream output_file("output.bin", std::ios::binary);
-
-    // Perform your final cleanup here
-    auto size = GBCachedInterpreter::code.getSize();
-    GBCachedInterpreter::code.resetSize();
-    output_file.write(
-        reinterpret_cast<const char*>(GBCachedInterpreter::code.getCurr()),
-        size);
-    output_file.close();
-
-    std::cout << "Cleanup complete. Exiting program." << std::endl;
-    std::exit(EXIT_SUCCESS);
+    Frontend::stop_requested = 1;
   }
 }
 
@@ -44,5 +31,34 @@ int main(int argc, char** argv) {
   std::signal(SIGINT, signal_handler);
   gui.run();
 
+  if (Frontend::stop_requested) {
+    std::cout << "Ctrl+C received. Performing final cleanup..." << std::endl;
+
+    if (auto& jit = gui.get_core_ref().jit) {
+      // the compile thread is still running
+      std::lock_guard lock(jit->compile_mutex);
+
+      // Open a file for writing in binary mode
+      std::ofstream output_file("output.bin", std::ios::binary);
+
+      // Perform your final cleanup here
+      auto size = jit->code.getSize();
+      jit->code.resetSize();
+      output_file.write(reinterpret_cast<const char*>(jit->code.getCurr()),
+                        size);
+      output_file.close();
+    }
+
+    // the translation cache is saved by ~Core, now that the core thread is
+    // done
+    std::cout << "Cleanup complete. Exiting program." << std::endl;
+  }
+
+  // not from signal_handler, which could interrupt the core thread while it
+  // holds stats_mutex
+  if (auto& jit = gui.get_core_ref().jit; jit && jit->block_stats_enabled) {
+    std::cout << jit->block_stats_report(20);
+  }
+
   return 0;
 }